@@ -10,15 +10,34 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <asm/amd_nb.h>
+#include <asm/msr.h>
+#include <linux/async.h>
+#include <linux/bitmap.h>
+#include <linux/cpu.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
 #include <linux/io.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/platform_device.h>
+#include <linux/sched/signal.h>
 #include <linux/semaphore.h>
+#include <linux/seq_file.h>
+#include <linux/smp.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 #include <linux/acpi.h>
 #include "amd_hsmp.h"  /* this will come from linux kernel as UAPI header */
+#include "amd_hsmp_kernel.h"  /* this will come from linux kernel as asm/amd_hsmp.h */
+
+#define CREATE_TRACE_POINTS
+#include "amd_hsmp_trace.h"
 
 #define DRIVER_NAME		"amd_hsmp"
 #define DRIVER_VERSION		"2.2"
@@ -56,13 +75,124 @@
 #define HSMP_METRICS_TABLE_NAME	"metrics_bin"
 
 #define HSMP_ATTR_GRP_NAME_SIZE	10
+#define HSMP_SOCK_CDEV_NAME	"hsmp%u"
+#define HSMP_SOCK_CDEV_NAME_SIZE	12
 
 /* These are the strings specified in ACPI table */
 #define MSG_IDOFF_STR		"MsgIdOffset"
 #define MSG_ARGOFF_STR		"MsgArgOffset"
 #define MSG_RESPOFF_STR		"MsgRspOffset"
 
-#define MAX_AMD_SOCKETS 8
+/* Per-core limits served from the per-socket cache */
+enum hsmp_core_limit_type {
+	HSMP_CORE_BOOST_LIMIT,
+	HSMP_CORE_CCLK_LIMIT,
+	HSMP_CORE_LIMIT_NR,
+};
+
+/* Socket power governor defaults */
+#define HSMP_GOV_INTERVAL_DEF	10
+#define HSMP_GOV_INTERVAL_MAX	1000
+
+/* Scalar metrics aggregated over a window per socket */
+enum hsmp_agg_metric {
+	HSMP_AGG_POWER,
+	HSMP_AGG_TEMP,
+	HSMP_AGG_C0,
+	HSMP_AGG_DDR_UTIL,
+	HSMP_AGG_CCLK_LIMIT,
+	HSMP_AGG_NR,
+};
+
+/* Aggregation defaults, a window holds at most HSMP_AGG_SAMPLES samples */
+#define HSMP_AGG_SAMPLES	1024
+#define HSMP_AGG_INTERVAL_MAX	1000
+#define HSMP_AGG_WINDOW_DEF	1000
+#define HSMP_AGG_WINDOW_MAX	60000
+
+/*
+ * Driver side message descriptor of one protocol version.
+ * type is HSMP_RSVD for messages the protocol version does not implement.
+ * The response of a cacheable message never changes while the driver is bound.
+ */
+struct hsmp_drv_msg_desc {
+	u8	num_args;
+	u8	response_sz;
+	s8	type;
+	bool	cacheable;
+};
+
+/* Longest response of a cacheable message */
+#define HSMP_CACHED_RESP_LEN	2
+
+/*
+ * All messages with: num_args, response_sz, type, oldest protocol version
+ * implementing it and cacheability. Shapes and types match
+ * hsmp_msg_desc_table of the UAPI header.
+ */
+#define HSMP_MSG_LIST(X, ver)											\
+	X(ver, HSMP_TEST,			1, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_GET_SMU_VER,		0, 1, HSMP_GET, 0,			true)		\
+	X(ver, HSMP_GET_PROTO_VER,		0, 1, HSMP_GET, 0,			true)		\
+	X(ver, HSMP_GET_SOCKET_POWER,		0, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_SET_SOCKET_POWER_LIMIT,	1, 0, HSMP_SET, 0,			false)		\
+	X(ver, HSMP_GET_SOCKET_POWER_LIMIT,	0, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_GET_SOCKET_POWER_LIMIT_MAX,	0, 1, HSMP_GET, 0,			true)		\
+	X(ver, HSMP_SET_BOOST_LIMIT,		1, 0, HSMP_SET, 0,			false)		\
+	X(ver, HSMP_SET_BOOST_LIMIT_SOCKET,	1, 0, HSMP_SET, 0,			false)		\
+	X(ver, HSMP_GET_BOOST_LIMIT,		1, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_GET_PROC_HOT,		0, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_SET_XGMI_LINK_WIDTH,	1, 0, HSMP_SET, 0,			false)		\
+	X(ver, HSMP_SET_DF_PSTATE,		1, 0, HSMP_SET, 0,			false)		\
+	X(ver, HSMP_SET_AUTO_DF_PSTATE,		0, 0, HSMP_SET, 0,			false)		\
+	X(ver, HSMP_GET_FCLK_MCLK,		0, 2, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_GET_CCLK_THROTTLE_LIMIT,	0, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_GET_C0_PERCENT,		0, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_SET_NBIO_DPM_LEVEL,		1, 0, HSMP_SET, 0,			false)		\
+	X(ver, HSMP_GET_NBIO_DPM_LEVEL,		1, 1, HSMP_GET, 0,			false)		\
+	X(ver, HSMP_GET_DDR_BANDWIDTH,		0, 1, HSMP_GET, HSMP_PROTO_VER3,	false)		\
+	X(ver, HSMP_GET_TEMP_MONITOR,		0, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_DIMM_TEMP_RANGE,	1, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_DIMM_POWER,		1, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_DIMM_THERMAL,		1, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_SOCKET_FREQ_LIMIT,	0, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_CCLK_CORE_LIMIT,	1, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_RAILS_SVI,		0, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_SOCKET_FMAX_FMIN,	0, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_IOLINK_BANDWITH,	1, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_XGMI_BANDWITH,		1, 1, HSMP_GET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_SET_GMI3_WIDTH,		1, 0, HSMP_SET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_SET_PCI_RATE,		1, 1, HSMP_SET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_SET_POWER_MODE,		1, 0, HSMP_SET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_SET_PSTATE_MAX_MIN,		1, 0, HSMP_SET, HSMP_PROTO_VER5,	false)		\
+	X(ver, HSMP_GET_METRIC_TABLE_VER,	0, 1, HSMP_GET, HSMP_PROTO_VER6,	true)		\
+	X(ver, HSMP_GET_METRIC_TABLE,		0, 0, HSMP_GET, HSMP_PROTO_VER6,	false)		\
+	X(ver, HSMP_GET_METRIC_TABLE_DRAM_ADDR,	0, 2, HSMP_GET, HSMP_PROTO_VER6,	true)
+
+#define HSMP_DRV_MSG_DESC(ver, id, nargs, rsp, t, min_ver, cache)		\
+	[id] = {								\
+		.num_args	= nargs,					\
+		.response_sz	= rsp,						\
+		.type		= (ver) >= (min_ver) ? (t) : HSMP_RSVD,	\
+		.cacheable	= cache,					\
+	},
+
+#define HSMP_DRV_MSG_DESC_TABLE(ver)					\
+	[ver] = {							\
+		[0] = { .type = HSMP_RSVD },				\
+		HSMP_MSG_LIST(HSMP_DRV_MSG_DESC, ver)			\
+	}
+
+#define HSMP_PROTO_VER_LATEST	HSMP_PROTO_VER6
+
+/* Descriptor tables of each protocol version, selected once at probe */
+static const struct hsmp_drv_msg_desc hsmp_drv_msg_desc_tables[][HSMP_MSG_ID_MAX] = {
+	HSMP_DRV_MSG_DESC_TABLE(HSMP_PROTO_VER2),
+	HSMP_DRV_MSG_DESC_TABLE(HSMP_PROTO_VER3),
+	HSMP_DRV_MSG_DESC_TABLE(HSMP_PROTO_VER4),
+	HSMP_DRV_MSG_DESC_TABLE(HSMP_PROTO_VER5),
+	HSMP_DRV_MSG_DESC_TABLE(HSMP_PROTO_VER6),
+};
 
 struct hsmp_mbaddr_info {
 	u32 base_addr;
@@ -72,28 +202,195 @@ struct hsmp_mbaddr_info {
 	u32 size;
 };
 
+/*
+ * Closed loop socket power governor state.
+ * target, interval_ms and limit_max are protected by lock,
+ * the remaining fields are only used by the work item.
+ * ctl_lock serializes starting and stopping the governor, including
+ * cancelling the work item and restoring the power limit.
+ */
+struct hsmp_governor {
+	struct delayed_work work;
+	struct mutex ctl_lock;
+	struct mutex lock;
+	u32 target;
+	u32 interval_ms;
+	u32 limit;
+	u32 limit_max;
+	u32 saved_limit;
+	s64 integral;
+};
+
+/* One aggregation tick, valid has a bit per metric read successfully */
+struct hsmp_agg_sample {
+	u64 stamp_ns;
+	u32 val[HSMP_AGG_NR];
+	u32 valid;
+};
+
+/*
+ * Windowed aggregation of the scalar metrics of a socket. Every interval_ms
+ * the work item appends a sample to the ring of the last HSMP_AGG_SAMPLES,
+ * readers compute the statistics of the samples of the last window_ms in
+ * scratch. All fields are protected by lock, ring and scratch are allocated
+ * when the aggregation is first enabled.
+ */
+struct hsmp_agg {
+	struct delayed_work work;
+	struct mutex lock;
+	u32 interval_ms;
+	u32 window_ms;
+	u32 head;
+	u32 count;
+	struct hsmp_agg_sample *ring;
+	u32 *scratch;
+};
+
+/*
+ * Per-core limits of the socket cores are refreshed all at once when
+ * a per-CPU sysfs file is read after the cached values expired.
+ */
+struct hsmp_core_cache {
+	struct mutex lock;
+	unsigned long expires[HSMP_CORE_LIMIT_NR];
+	bool valid[HSMP_CORE_LIMIT_NR];
+};
+
+/* Mailbox round-trips of a socket, updated with the socket locked */
+struct hsmp_sock_stats {
+	u64 sent;
+	u64 failed;
+	u64 timedout;
+};
+
+/*
+ * Per socket state is allocated on the NUMA node of the socket and
+ * aligned to cache lines, so traffic on one socket does not bounce
+ * the lines holding the state of another.
+ */
 struct hsmp_socket {
 	struct bin_attribute hsmp_attr;
+	struct hsmp_governor gov;
+	struct hsmp_agg agg;
+	struct hsmp_core_cache core_cache;
 	struct hsmp_mbaddr_info mbinfo;
 	void __iomem *metric_tbl_addr;
 	void __iomem *virt_base_addr;
+	void __iomem *ecam_base;
+	struct hsmp_sim_mbox *sim;
 	struct semaphore hsmp_sem;
+	atomic_t hi_waiters;
+	wait_queue_head_t lo_wq;
+	struct xarray shadow;
+	DECLARE_BITMAP(supported, HSMP_MSG_ID_MAX);
+	DECLARE_BITMAP(cached, HSMP_MSG_ID_MAX);
+	u32 cache[HSMP_MSG_ID_MAX][HSMP_CACHED_RESP_LEN];
+	struct hsmp_shared_page *shared;
+	u64 recent_floor_ns;
+	struct delayed_work refresh;
+	atomic_t mappers;
+	struct hsmp_sock_stats stats;
+	struct miscdevice cdev;
+	spinlock_t open_lock;
+	unsigned int open_count;
+	struct file *excl_owner;
+	bool cdev_registered;
+	bool unbound;
+	char cdev_name[HSMP_SOCK_CDEV_NAME_SIZE];
 	char name[HSMP_ATTR_GRP_NAME_SIZE];
 	struct pci_dev *root;
 	struct device *dev;
+	const struct hsmp_mbox_ops *ops;
+	unsigned int cpu;
 	u16 sock_ind;
-};
+} ____cacheline_aligned_in_smp;
 
 struct hsmp_plat_device {
 	struct miscdevice hsmp_device;
-	struct hsmp_socket *sock;
+	struct hsmp_socket **sock;
+	const struct hsmp_drv_msg_desc *msg_desc;
+	u32 *core_limits[HSMP_CORE_LIMIT_NR];
+	struct cpumask cpu_sysfs;	/* CPUs with a cpuN/hsmp directory */
+	struct dentry *debugfs;
+	int cpuhp_state;
 	u32 proto_ver;
 	u16 num_sockets;
 	bool is_acpi_device;
 	bool is_probed;
 };
 
-static struct hsmp_plat_device plat_dev;
+static struct hsmp_plat_device plat_dev = {
+	.msg_desc = hsmp_drv_msg_desc_tables[HSMP_PROTO_VER2],
+};
+
+/* Serializes the shared setup done by the probes and the async socket init */
+static DEFINE_MUTEX(hsmp_probe_lock);
+static ASYNC_DOMAIN_EXCLUSIVE(hsmp_async_domain);
+
+static unsigned int gov_kp = 500;
+module_param(gov_kp, uint, 0644);
+MODULE_PARM_DESC(gov_kp, "Socket power governor proportional gain in 1/1000 units");
+
+static unsigned int gov_ki = 100;
+module_param(gov_ki, uint, 0644);
+MODULE_PARM_DESC(gov_ki, "Socket power governor integral gain in 1/1000 units");
+
+static bool shadow_sets = true;
+module_param(shadow_sets, bool, 0644);
+MODULE_PARM_DESC(shadow_sets, "Skip SET messages re-applying the last applied value");
+
+static unsigned int core_limit_ttl_ms = 100;
+module_param(core_limit_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(core_limit_ttl_ms, "Lifetime of the cached per-CPU sysfs limits in milliseconds");
+
+static unsigned int get_max_age_ms;
+module_param(get_max_age_ms, uint, 0644);
+MODULE_PARM_DESC(get_max_age_ms, "Serve GET messages without arguments from results up to this old, 0 disables");
+
+static unsigned int fd_rate;
+module_param(fd_rate, uint, 0644);
+MODULE_PARM_DESC(fd_rate, "Messages per second allowed to each read-only open file, 0 for no limit");
+
+static unsigned int fd_burst = 32;
+module_param(fd_burst, uint, 0644);
+MODULE_PARM_DESC(fd_burst, "Messages a read-only open file may send at once above fd_rate");
+
+static unsigned int shared_refresh_ms;
+module_param(shared_refresh_ms, uint, 0644);
+MODULE_PARM_DESC(shared_refresh_ms, "Refresh the mapped shared pages this often in milliseconds, 0 disables");
+
+static bool probe_handshake = true;
+module_param(probe_handshake, bool, 0444);
+MODULE_PARM_DESC(probe_handshake, "Run the HSMP_TEST handshake when probing a socket");
+
+static bool numa_local_mbox;
+module_param(numa_local_mbox, bool, 0644);
+MODULE_PARM_DESC(numa_local_mbox, "Access the PCI mailbox registers from a CPU of the target socket");
+
+static bool sim_mbox;
+module_param(sim_mbox, bool, 0444);
+MODULE_PARM_DESC(sim_mbox, "Use a simulated mailbox instead of the SMU, for testing without HSMP hardware");
+
+static unsigned int sim_latency_us = 100;
+module_param(sim_latency_us, uint, 0644);
+MODULE_PARM_DESC(sim_latency_us, "Response time of the simulated mailbox in microseconds");
+
+static bool ecam_mbox;
+module_param(ecam_mbox, bool, 0444);
+MODULE_PARM_DESC(ecam_mbox, "Access the PCI mailbox registers through a direct ECAM mapping");
+
+/*
+ * Mailbox register transport of a socket, selected once at probe.
+ * rdwr is a single ordered register access, the block accessors move the
+ * argument and response words. numa_local transports gain from issuing
+ * their accesses on the target socket.
+ */
+struct hsmp_mbox_ops {
+	int (*rdwr)(struct hsmp_socket *sock, u32 offset, u32 *value, bool write);
+	int (*write_block)(struct hsmp_socket *sock, u32 offset, const u32 *buf, u16 count);
+	int (*read_block)(struct hsmp_socket *sock, u32 offset, u32 *buf, u16 count);
+	bool numa_local;
+};
 
 static int amd_hsmp_pci_rdwr(struct hsmp_socket *sock, u32 offset,
 			     u32 *value, bool write)
@@ -114,73 +411,387 @@ static int amd_hsmp_pci_rdwr(struct hsmp_socket *sock, u32 offset,
 	return ret;
 }
 
-static void amd_hsmp_acpi_rdwr(struct hsmp_socket *sock, u32 offset,
-			       u32 *value, bool write)
+/* Config space goes through the index/data pair, one word at a time */
+static int amd_hsmp_pci_write_block(struct hsmp_socket *sock, u32 offset,
+				    const u32 *buf, u16 count)
+{
+	u32 value;
+	u16 i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		value = buf[i];
+		ret = amd_hsmp_pci_rdwr(sock, offset + (i << 2), &value, HSMP_WR);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int amd_hsmp_pci_read_block(struct hsmp_socket *sock, u32 offset,
+				   u32 *buf, u16 count)
+{
+	u16 i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		ret = amd_hsmp_pci_rdwr(sock, offset + (i << 2), &buf[i], HSMP_RD);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static const struct hsmp_mbox_ops hsmp_pci_mbox_ops = {
+	.rdwr		= amd_hsmp_pci_rdwr,
+	.write_block	= amd_hsmp_pci_write_block,
+	.read_block	= amd_hsmp_pci_read_block,
+	.numa_local	= true,
+};
+
+/*
+ * The HSMP index/data pair of the root complex is only used by this driver
+ * and every access is made with the socket locked, so the mapped config
+ * space can be accessed without pci_lock.
+ */
+static int amd_hsmp_ecam_rdwr(struct hsmp_socket *sock, u32 offset,
+			      u32 *value, bool write)
+{
+	writel(sock->mbinfo.base_addr + offset, sock->ecam_base + HSMP_INDEX_REG);
+
+	if (write)
+		writel(*value, sock->ecam_base + HSMP_DATA_REG);
+	else
+		*value = readl(sock->ecam_base + HSMP_DATA_REG);
+
+	return 0;
+}
+
+static int amd_hsmp_ecam_write_block(struct hsmp_socket *sock, u32 offset,
+				     const u32 *buf, u16 count)
+{
+	u32 value;
+	u16 i;
+
+	for (i = 0; i < count; i++) {
+		value = buf[i];
+		amd_hsmp_ecam_rdwr(sock, offset + (i << 2), &value, HSMP_WR);
+	}
+
+	return 0;
+}
+
+static int amd_hsmp_ecam_read_block(struct hsmp_socket *sock, u32 offset,
+				    u32 *buf, u16 count)
+{
+	u16 i;
+
+	for (i = 0; i < count; i++)
+		amd_hsmp_ecam_rdwr(sock, offset + (i << 2), &buf[i], HSMP_RD);
+
+	return 0;
+}
+
+static const struct hsmp_mbox_ops hsmp_ecam_mbox_ops = {
+	.rdwr		= amd_hsmp_ecam_rdwr,
+	.write_block	= amd_hsmp_ecam_write_block,
+	.read_block	= amd_hsmp_ecam_read_block,
+	.numa_local	= true,
+};
+
+static int amd_hsmp_acpi_rdwr(struct hsmp_socket *sock, u32 offset,
+			      u32 *value, bool write)
 {
 	if (write)
 		iowrite32(*value, sock->virt_base_addr + offset);
 	else
 		*value = ioread32(sock->virt_base_addr + offset);
+
+	return 0;
+}
+
+/*
+ * The argument and response words need no ordering among themselves.
+ * The arguments are ordered before the SMU sees them by the ordered
+ * message ID write, the response after the ordered status read.
+ */
+static int amd_hsmp_acpi_write_block(struct hsmp_socket *sock, u32 offset,
+				     const u32 *buf, u16 count)
+{
+	void __iomem *addr = sock->virt_base_addr + offset;
+	u16 i;
+
+	for (i = 0; i < count; i++)
+		writel_relaxed(buf[i], addr + (i << 2));
+
+	return 0;
 }
 
-static int amd_hsmp_rdwr(struct hsmp_socket *sock, u32 offset,
-			 u32 *value, bool write)
+static int amd_hsmp_acpi_read_block(struct hsmp_socket *sock, u32 offset,
+				    u32 *buf, u16 count)
 {
-	if (plat_dev.is_acpi_device)
-		amd_hsmp_acpi_rdwr(sock, offset, value, write);
-	else
-		return amd_hsmp_pci_rdwr(sock, offset, value, write);
+	void __iomem *addr = sock->virt_base_addr + offset;
+	u16 i;
+
+	for (i = 0; i < count; i++)
+		buf[i] = readl_relaxed(addr + (i << 2));
 
 	return 0;
 }
 
+static const struct hsmp_mbox_ops hsmp_acpi_mbox_ops = {
+	.rdwr		= amd_hsmp_acpi_rdwr,
+	.write_block	= amd_hsmp_acpi_write_block,
+	.read_block	= amd_hsmp_acpi_read_block,
+};
+
 /*
- * Send a message to the HSMP port via PCI-e config space registers
- * or by writing to MMIO space.
- *
- * The caller is expected to zero out any unused arguments.
- * If a response is expected, the number of response words should be greater than 0.
- *
- * Returns 0 for success and populates the requested number of arguments.
- * Returns a negative error code for failure.
+ * Simulated mailbox registers. A message completes sim_latency_us after
+ * its ID is written; HSMP_TEST and the version queries answer like the SMU,
+ * other implemented messages return zeros.
  */
-static int __hsmp_send_message(struct hsmp_socket *sock, struct hsmp_message *msg)
+struct hsmp_sim_mbox {
+	u32 args[HSMP_MAX_MSG_LEN];
+	u32 status;
+	u64 ready_ns;
+};
+
+#define HSMP_SIM_SMU_VER	0x00FFFFFF
+
+static void hsmp_sim_exec(struct hsmp_sim_mbox *sim, u32 msg_id)
 {
-	struct hsmp_mbaddr_info *mbinfo;
-	unsigned long timeout, short_sleep;
-	u32 mbox_status;
+	sim->status	= HSMP_STATUS_OK;
+	sim->ready_ns	= ktime_get_ns() + (u64)READ_ONCE(sim_latency_us) * NSEC_PER_USEC;
+
+	switch (msg_id) {
+	case HSMP_TEST:
+		sim->args[0]++;
+		break;
+	case HSMP_GET_SMU_VER:
+		sim->args[0] = HSMP_SIM_SMU_VER;
+		break;
+	case HSMP_GET_PROTO_VER:
+		sim->args[0] = HSMP_PROTO_VER5;
+		break;
+	default:
+		if (msg_id >= HSMP_MSG_ID_MAX ||
+		    hsmp_drv_msg_desc_tables[HSMP_PROTO_VER5][msg_id].type == HSMP_RSVD)
+			sim->status = HSMP_ERR_INVALID_MSG;
+		else
+			memset(sim->args, 0, sizeof(sim->args));
+	}
+}
+
+static int hsmp_sim_rdwr(struct hsmp_socket *sock, u32 offset, u32 *value, bool write)
+{
+	struct hsmp_mbaddr_info *mbinfo = &sock->mbinfo;
+	struct hsmp_sim_mbox *sim = sock->sim;
 	u32 index;
+
+	if (offset == mbinfo->msg_resp_off) {
+		if (write) {
+			sim->status	= *value;
+			sim->ready_ns	= 0;
+		} else {
+			*value = ktime_get_ns() < sim->ready_ns ? HSMP_STATUS_NOT_READY
+								: sim->status;
+		}
+	} else if (offset == mbinfo->msg_id_off) {
+		if (write)
+			hsmp_sim_exec(sim, *value);
+	} else {
+		index = (offset - mbinfo->msg_arg_off) >> 2;
+		if (index >= HSMP_MAX_MSG_LEN)
+			return -EINVAL;
+		if (write)
+			sim->args[index] = *value;
+		else
+			*value = sim->args[index];
+	}
+
+	return 0;
+}
+
+static int hsmp_sim_write_block(struct hsmp_socket *sock, u32 offset,
+				const u32 *buf, u16 count)
+{
+	u32 value;
+	u16 i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		value = buf[i];
+		ret = hsmp_sim_rdwr(sock, offset + (i << 2), &value, HSMP_WR);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int hsmp_sim_read_block(struct hsmp_socket *sock, u32 offset,
+			       u32 *buf, u16 count)
+{
+	u16 i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		ret = hsmp_sim_rdwr(sock, offset + (i << 2), &buf[i], HSMP_RD);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static const struct hsmp_mbox_ops hsmp_sim_mbox_ops = {
+	.rdwr		= hsmp_sim_rdwr,
+	.write_block	= hsmp_sim_write_block,
+	.read_block	= hsmp_sim_read_block,
+};
+
+/*
+ * State of one mailbox transaction, shared by its register phases which
+ * may run on a CPU of the target socket.
+ */
+struct hsmp_xfer {
+	struct hsmp_socket *sock;
+	struct hsmp_message *msg;
+	u32 mbox_status;
 	int ret;
+};
 
-	mbinfo = &sock->mbinfo;
+/* Clear the status register, write the arguments and trigger the message */
+static void hsmp_xfer_start(void *data)
+{
+	struct hsmp_xfer *xfer = data;
+	struct hsmp_socket *sock = xfer->sock;
+	struct hsmp_message *msg = xfer->msg;
+	struct hsmp_mbaddr_info *mbinfo = &sock->mbinfo;
+	const struct hsmp_mbox_ops *ops = sock->ops;
+	u32 mbox_status = HSMP_STATUS_NOT_READY;
+	int ret;
 
-	/* Clear the status register */
-	mbox_status = HSMP_STATUS_NOT_READY;
-	ret = amd_hsmp_rdwr(sock, mbinfo->msg_resp_off, &mbox_status, HSMP_WR);
+	ret = ops->rdwr(sock, mbinfo->msg_resp_off, &mbox_status, HSMP_WR);
 	if (ret) {
 		pr_err("Error %d clearing mailbox status register\n", ret);
-		return ret;
+		goto out;
 	}
 
-	index = 0;
 	/* Write any message arguments */
-	while (index < msg->num_args) {
-		ret = amd_hsmp_rdwr(sock, mbinfo->msg_arg_off + (index << 2),
-				    &msg->args[index], HSMP_WR);
-		if (ret) {
-			pr_err("Error %d writing message argument %d\n", ret, index);
-			return ret;
-		}
-		index++;
+	ret = ops->write_block(sock, mbinfo->msg_arg_off, msg->args, msg->num_args);
+	if (ret) {
+		pr_err("Error %d writing message arguments\n", ret);
+		goto out;
 	}
 
 	/* Write the message ID which starts the operation */
-	ret = amd_hsmp_rdwr(sock, mbinfo->msg_id_off, &msg->msg_id, HSMP_WR);
-	if (ret) {
+	ret = ops->rdwr(sock, mbinfo->msg_id_off, &msg->msg_id, HSMP_WR);
+	if (ret)
 		pr_err("Error %d writing message ID %u\n", ret, msg->msg_id);
-		return ret;
+out:
+	xfer->ret = ret;
+}
+
+static void hsmp_xfer_status(void *data)
+{
+	struct hsmp_xfer *xfer = data;
+	struct hsmp_socket *sock = xfer->sock;
+
+	xfer->ret = sock->ops->rdwr(sock, sock->mbinfo.msg_resp_off,
+				    &xfer->mbox_status, HSMP_RD);
+	if (xfer->ret)
+		pr_err("Error %d reading mailbox status\n", xfer->ret);
+}
+
+/*
+ * SMU has responded OK. Read response data.
+ * SMU reads the input arguments from eight 32 bit registers starting
+ * from SMN_HSMP_MSG_DATA and writes the response data to the same
+ * SMN_HSMP_MSG_DATA address.
+ * We copy the response data if any, back to the args[].
+ */
+static void hsmp_xfer_finish(void *data)
+{
+	struct hsmp_xfer *xfer = data;
+	struct hsmp_socket *sock = xfer->sock;
+	struct hsmp_message *msg = xfer->msg;
+	int ret;
+
+	ret = sock->ops->read_block(sock, sock->mbinfo.msg_arg_off, msg->args,
+				    msg->response_sz);
+	if (ret)
+		pr_err("Error %d reading response for message ID:%u\n",
+		       ret, msg->msg_id);
+	xfer->ret = ret;
+}
+
+/* Online CPU of the socket to run the register phases on, nr_cpu_ids if none */
+static unsigned int hsmp_sock_cpu(struct hsmp_socket *sock)
+{
+	unsigned int cpu = READ_ONCE(sock->cpu);
+
+	if (cpu < nr_cpu_ids && cpu_online(cpu) &&
+	    topology_logical_package_id(cpu) == sock->sock_ind)
+		return cpu;
+
+	for_each_online_cpu(cpu) {
+		if (topology_logical_package_id(cpu) == sock->sock_ind) {
+			WRITE_ONCE(sock->cpu, cpu);
+			return cpu;
+		}
+	}
+
+	return nr_cpu_ids;
+}
+
+/*
+ * Run one register phase of a transaction. With numa_local_mbox set, the
+ * config space accesses of a caller on a remote socket are issued from a
+ * CPU of the target socket so they do not each cross the fabric. Falls
+ * back to the calling CPU if the socket has no online CPU left.
+ */
+static void hsmp_xfer_phase(struct hsmp_xfer *xfer, smp_call_func_t phase)
+{
+	struct hsmp_socket *sock = xfer->sock;
+	unsigned int cpu;
+
+	if (READ_ONCE(numa_local_mbox) && sock->ops->numa_local &&
+	    topology_logical_package_id(raw_smp_processor_id()) != sock->sock_ind) {
+		cpu = hsmp_sock_cpu(sock);
+		if (cpu < nr_cpu_ids && !smp_call_function_single(cpu, phase, xfer, 1))
+			return;
 	}
 
+	phase(xfer);
+}
+
+/*
+ * Send a message to the HSMP port via PCI-e config space registers
+ * or by writing to MMIO space.
+ *
+ * The caller is expected to zero out any unused arguments.
+ * If a response is expected, the number of response words should be greater than 0.
+ *
+ * Returns 0 for success and populates the requested number of arguments.
+ * Returns a negative error code for failure.
+ */
+static int __hsmp_send_message(struct hsmp_socket *sock, struct hsmp_message *msg)
+{
+	struct hsmp_xfer xfer = { .sock = sock, .msg = msg };
+	unsigned long timeout, short_sleep;
+	u64 start = 0;
+	u32 mbox_status;
+
+	if (trace_hsmp_mbox_enabled())
+		start = ktime_get_ns();
+
+	hsmp_xfer_phase(&xfer, hsmp_xfer_start);
+	if (xfer.ret)
+		return xfer.ret;
+
 	/*
 	 * Depending on when the trigger write completes relative to the SMU
 	 * firmware 1 ms cycle, the operation may take from tens of us to 1 ms
@@ -191,14 +802,13 @@ static int __hsmp_send_message(struct hsmp_socket *sock, struct hsmp_message *ms
 	short_sleep = jiffies + msecs_to_jiffies(HSMP_SHORT_SLEEP);
 	timeout	= jiffies + msecs_to_jiffies(HSMP_MSG_TIMEOUT);
 
+	xfer.mbox_status = HSMP_STATUS_NOT_READY;
 	while (time_before(jiffies, timeout)) {
-		ret = amd_hsmp_rdwr(sock, mbinfo->msg_resp_off, &mbox_status, HSMP_RD);
-		if (ret) {
-			pr_err("Error %d reading mailbox status\n", ret);
-			return ret;
-		}
+		hsmp_xfer_phase(&xfer, hsmp_xfer_status);
+		if (xfer.ret)
+			return xfer.ret;
 
-		if (mbox_status != HSMP_STATUS_NOT_READY)
+		if (xfer.mbox_status != HSMP_STATUS_NOT_READY)
 			break;
 		if (time_before(jiffies, short_sleep))
 			usleep_range(50, 100);
@@ -206,6 +816,11 @@ static int __hsmp_send_message(struct hsmp_socket *sock, struct hsmp_message *ms
 			usleep_range(1000, 2000);
 	}
 
+	mbox_status = xfer.mbox_status;
+	if (start)
+		trace_hsmp_mbox(sock->sock_ind, msg->msg_id, mbox_status,
+				ktime_get_ns() - start);
+
 	if (unlikely(mbox_status == HSMP_STATUS_NOT_READY)) {
 		return -ETIMEDOUT;
 	} else if (unlikely(mbox_status == HSMP_ERR_INVALID_MSG)) {
@@ -218,77 +833,449 @@ static int __hsmp_send_message(struct hsmp_socket *sock, struct hsmp_message *ms
 		return -EIO;
 	}
 
-	/*
-	 * SMU has responded OK. Read response data.
-	 * SMU reads the input arguments from eight 32 bit registers starting
-	 * from SMN_HSMP_MSG_DATA and writes the response data to the same
-	 * SMN_HSMP_MSG_DATA address.
-	 * We copy the response data if any, back to the args[].
-	 */
-	index = 0;
-	while (index < msg->response_sz) {
-		ret = amd_hsmp_rdwr(sock, mbinfo->msg_arg_off + (index << 2),
-				    &msg->args[index], HSMP_RD);
-		if (ret) {
-			pr_err("Error %d reading response %u for message ID:%u\n",
-			       ret, index, msg->msg_id);
-			break;
-		}
-		index++;
-	}
+	hsmp_xfer_phase(&xfer, hsmp_xfer_finish);
 
-	return ret;
+	return xfer.ret;
 }
 
 static int validate_message(struct hsmp_message *msg)
 {
+	const struct hsmp_drv_msg_desc *desc;
+
 	/* msg_id against valid range of message IDs */
 	if (msg->msg_id < HSMP_TEST || msg->msg_id >= HSMP_MSG_ID_MAX)
 		return -ENOMSG;
 
-	/* msg_id is a reserved message ID */
-	if (hsmp_msg_desc_table[msg->msg_id].type == HSMP_RSVD)
+	desc = &plat_dev.msg_desc[msg->msg_id];
+
+	/* msg_id is a reserved message ID or not part of the protocol version */
+	if (desc->type == HSMP_RSVD)
 		return -ENOMSG;
 
 	/* num_args and response_sz against the HSMP spec */
-	if (msg->num_args != hsmp_msg_desc_table[msg->msg_id].num_args ||
-	    msg->response_sz != hsmp_msg_desc_table[msg->msg_id].response_sz)
+	if (msg->num_args != desc->num_args || msg->response_sz != desc->response_sz)
 		return -EINVAL;
 
 	return 0;
 }
 
-int hsmp_send_message(struct hsmp_message *msg)
+static const struct hsmp_drv_msg_desc *hsmp_select_msg_desc(u32 proto_ver)
 {
-	struct hsmp_socket *sock;
+	if (proto_ver < HSMP_PROTO_VER2)
+		proto_ver = HSMP_PROTO_VER2;
+	else if (proto_ver > HSMP_PROTO_VER_LATEST)
+		proto_ver = HSMP_PROTO_VER_LATEST;
+
+	return hsmp_drv_msg_desc_tables[proto_ver];
+}
+
+/*
+ * Serve a cacheable message from the socket cache. The cache is filled once
+ * with the socket locked and read locklessly.
+ */
+static bool hsmp_get_cached(struct hsmp_socket *sock, struct hsmp_message *msg)
+{
+	if (!plat_dev.msg_desc[msg->msg_id].cacheable ||
+	    !test_bit(msg->msg_id, sock->cached))
+		return false;
+
+	smp_rmb();
+	memcpy(msg->args, sock->cache[msg->msg_id],
+	       min_t(u16, msg->response_sz, HSMP_CACHED_RESP_LEN) * sizeof(u32));
+
+	return true;
+}
+
+static void hsmp_set_cached(struct hsmp_socket *sock, struct hsmp_message *msg)
+{
+	if (!plat_dev.msg_desc[msg->msg_id].cacheable ||
+	    test_bit(msg->msg_id, sock->cached))
+		return;
+
+	memcpy(sock->cache[msg->msg_id], msg->args,
+	       min_t(u16, msg->response_sz, HSMP_CACHED_RESP_LEN) * sizeof(u32));
+	smp_wmb();
+	set_bit(msg->msg_id, sock->cached);
+}
+
+/* GET messages whose recent results can be shared by all callers */
+static inline bool hsmp_get_recordable(u32 msg_id)
+{
+	const struct hsmp_drv_msg_desc *desc = &plat_dev.msg_desc[msg_id];
+
+	return desc->type == HSMP_GET && !desc->num_args && desc->response_sz &&
+	       desc->response_sz <= HSMP_CACHED_RESP_LEN && !desc->cacheable;
+}
+
+/*
+ * Serve a GET message from a result younger than get_max_age_ms, so that
+ * callers polling the same value share one mailbox access. Lockless, retries
+ * if the entry is updated meanwhile.
+ */
+static bool hsmp_get_recent(struct hsmp_socket *sock, struct hsmp_message *msg)
+{
+	struct hsmp_shared_entry *entry = &sock->shared->entries[msg->msg_id];
+	u32 max_age_ms = READ_ONCE(get_max_age_ms);
+	u64 stamp;
+	u32 seq;
+
+	if (!max_age_ms || !hsmp_get_recordable(msg->msg_id))
+		return false;
+
+	do {
+		seq = READ_ONCE(entry->seq);
+		if (seq & 1)
+			return false;
+		smp_rmb();
+
+		stamp = READ_ONCE(entry->stamp_ns);
+		if (stamp <= READ_ONCE(sock->recent_floor_ns) ||
+		    ktime_get_ns() - stamp > (u64)max_age_ms * NSEC_PER_MSEC)
+			return false;
+		memcpy(msg->args, entry->args, msg->response_sz * sizeof(u32));
+
+		smp_rmb();
+	} while (READ_ONCE(entry->seq) != seq);
+
+	return true;
+}
+
+/* Update an entry of the shared page with the socket locked */
+static void hsmp_set_recent(struct hsmp_socket *sock, u32 msg_id, const u32 *args)
+{
+	struct hsmp_shared_entry *entry = &sock->shared->entries[msg_id];
+
+	WRITE_ONCE(entry->seq, entry->seq + 1);
+	smp_wmb();
+	memcpy(entry->args, args, sizeof(entry->args));
+	WRITE_ONCE(entry->stamp_ns, ktime_get_ns());
+	smp_wmb();
+	WRITE_ONCE(entry->seq, entry->seq + 1);
+}
+
+/*
+ * Record the result of a GET message. A SET message may change any of the
+ * recorded values, so none recorded so far is served to callers anymore.
+ * They stay in the shared page, which holds last-known values.
+ */
+static void hsmp_record_recent(struct hsmp_socket *sock, struct hsmp_message *msg)
+{
+	if (plat_dev.msg_desc[msg->msg_id].type == HSMP_SET)
+		WRITE_ONCE(sock->recent_floor_ns, ktime_get_ns());
+	else if (hsmp_get_recordable(msg->msg_id))
+		hsmp_set_recent(sock, msg->msg_id, msg->args);
+}
+
+/*
+ * Describes the state changed by a SET message.
+ *
+ * The bits of args[0] in key_mask select the object (core, NBIO) the message
+ * applies to. get_id is the GET message returning the current value, it takes
+ * the key bits shifted right by key_shift and returns the value in val_mask.
+ * Shadowed messages are idempotent, re-sending the last applied argument is
+ * a no-op. Their last applied argument is recorded, but only the messages
+ * with a get_id skip the mailbox when it is repeated: without a readback
+ * the driver cannot see a change made behind it. invalidates lists the
+ * messages whose state is overridden.
+ */
+struct hsmp_set_desc {
+	u32 get_id;
+	u32 key_mask;
+	u32 key_shift;
+	u32 val_mask;
+	u64 invalidates;
+	bool shadowed;
+};
+
+static const struct hsmp_set_desc hsmp_set_desc_table[HSMP_MSG_ID_MAX] = {
+	[HSMP_SET_SOCKET_POWER_LIMIT]	= { HSMP_GET_SOCKET_POWER_LIMIT, 0, 0, GENMASK(31, 0),
+					    0, true },
+	[HSMP_SET_BOOST_LIMIT]		= { HSMP_GET_BOOST_LIMIT, GENMASK(31, 16), 16, GENMASK(15, 0),
+					    BIT_ULL(HSMP_SET_BOOST_LIMIT_SOCKET), true },
+	[HSMP_SET_BOOST_LIMIT_SOCKET]	= { 0, 0, 0, 0, BIT_ULL(HSMP_SET_BOOST_LIMIT), true },
+	[HSMP_SET_XGMI_LINK_WIDTH]	= { 0, 0, 0, 0, 0, true },
+	[HSMP_SET_DF_PSTATE]		= { 0, 0, 0, 0, BIT_ULL(HSMP_SET_PSTATE_MAX_MIN), true },
+	[HSMP_SET_AUTO_DF_PSTATE]	= { 0, 0, 0, 0, BIT_ULL(HSMP_SET_DF_PSTATE) |
+					    BIT_ULL(HSMP_SET_PSTATE_MAX_MIN), false },
+	[HSMP_SET_NBIO_DPM_LEVEL]	= { HSMP_GET_NBIO_DPM_LEVEL, GENMASK(23, 16), 0, GENMASK(15, 0),
+					    0, true },
+	[HSMP_SET_GMI3_WIDTH]		= { 0, 0, 0, 0, 0, true },
+	[HSMP_SET_POWER_MODE]		= { 0, 0, 0, 0, 0, true },
+	[HSMP_SET_PSTATE_MAX_MIN]	= { 0, 0, 0, 0, BIT_ULL(HSMP_SET_DF_PSTATE), true },
+};
+
+/* GET messages reading back the state of a shadowed SET message */
+static const u32 hsmp_shadow_readback[HSMP_MSG_ID_MAX] = {
+	[HSMP_GET_SOCKET_POWER_LIMIT]	= HSMP_SET_SOCKET_POWER_LIMIT,
+	[HSMP_GET_BOOST_LIMIT]		= HSMP_SET_BOOST_LIMIT,
+	[HSMP_GET_NBIO_DPM_LEVEL]	= HSMP_SET_NBIO_DPM_LEVEL,
+};
+
+/* The shadow index holds the message ID in the upper 32 bits and the key bits below */
+static inline unsigned long hsmp_shadow_index(u32 msg_id, u32 key)
+{
+	return ((unsigned long)msg_id << 32) | key;
+}
+
+static void hsmp_shadow_erase_msg(struct hsmp_socket *sock, u32 msg_id)
+{
+	unsigned long index;
+	void *entry;
+
+	xa_for_each_range(&sock->shadow, index, entry,
+			  hsmp_shadow_index(msg_id, 0),
+			  hsmp_shadow_index(msg_id, U32_MAX))
+		xa_erase(&sock->shadow, index);
+}
+
+/*
+ * Release the mailbox of a socket. Low priority callers wait on lo_wq
+ * rather than on the semaphore, so every release must wake them.
+ */
+static void hsmp_sock_unlock(struct hsmp_socket *sock)
+{
+	up(&sock->hsmp_sem);
+	wake_up(&sock->lo_wq);
+}
+
+/*
+ * Re-send every shadowed SET message in one pass with the socket locked,
+ * e.g. after the SMU lost its settings across suspend. Entries the SMU
+ * rejects are dropped. Returns the number of messages that failed.
+ */
+static int hsmp_shadow_replay(struct hsmp_socket *sock)
+{
+	struct hsmp_message msg;
+	unsigned long index;
+	int failed = 0;
+	void *entry;
+
+	down(&sock->hsmp_sem);
+	xa_for_each(&sock->shadow, index, entry) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_id	= index >> 32;
+		msg.num_args	= plat_dev.msg_desc[msg.msg_id].num_args;
+		msg.response_sz	= plat_dev.msg_desc[msg.msg_id].response_sz;
+		msg.sock_ind	= sock->sock_ind;
+		msg.args[0]	= xa_to_value(entry);
+
+		if (__hsmp_send_message(sock, &msg)) {
+			xa_erase(&sock->shadow, index);
+			failed++;
+		}
+	}
+	hsmp_sock_unlock(sock);
+
+	return failed;
+}
+
+/* Drop all shadowed state, the next SET of every message reaches the SMU */
+static void hsmp_shadow_invalidate(struct hsmp_socket *sock)
+{
+	xa_destroy(&sock->shadow);
+}
+
+/*
+ * Track the state applied by a message once it has been sent.
+ * A failed SET leaves the state unknown, and a GET reading back a value
+ * different from the shadow means it was changed behind the driver.
+ */
+static void hsmp_shadow_update(struct hsmp_socket *sock, struct hsmp_message *msg,
+			       u32 arg, int status)
+{
+	const struct hsmp_set_desc *desc;
+	unsigned long index;
+	u32 set_id, key;
+	void *entry;
+	int i;
+
+	if (plat_dev.msg_desc[msg->msg_id].type == HSMP_GET) {
+		set_id = hsmp_shadow_readback[msg->msg_id];
+		if (!set_id || status)
+			return;
+
+		desc	= &hsmp_set_desc_table[set_id];
+		key	= (arg << desc->key_shift) & desc->key_mask;
+		index	= hsmp_shadow_index(set_id, key);
+		entry	= xa_load(&sock->shadow, index);
+		if (entry && (xa_to_value(entry) & desc->val_mask) !=
+			     (msg->args[0] & desc->val_mask))
+			xa_erase(&sock->shadow, index);
+		return;
+	}
+
+	desc	= &hsmp_set_desc_table[msg->msg_id];
+	index	= hsmp_shadow_index(msg->msg_id, arg & desc->key_mask);
+
+	if (status) {
+		xa_erase(&sock->shadow, index);
+		return;
+	}
+
+	for (i = 0; i < HSMP_MSG_ID_MAX; i++) {
+		if (desc->invalidates & BIT_ULL(i))
+			hsmp_shadow_erase_msg(sock, i);
+	}
+
+	if (desc->shadowed && READ_ONCE(shadow_sets) &&
+	    !xa_is_err(xa_store(&sock->shadow, index, xa_mk_value(arg), GFP_KERNEL)))
+		return;
+
+	/*
+	 * A value applied but not recorded, e.g. with shadow_sets turned off
+	 * meanwhile, must not let an older entry skip a later SET.
+	 */
+	xa_erase(&sock->shadow, index);
+}
+
+/*
+ * Send a message with the socket locked. A shadowed SET message with a
+ * readback, carrying the argument that was last applied successfully,
+ * completes without touching the mailbox.
+ */
+static int hsmp_send_locked(struct hsmp_socket *sock, struct hsmp_message *msg)
+{
+	const struct hsmp_set_desc *desc = &hsmp_set_desc_table[msg->msg_id];
+	u32 arg = msg->args[0];
+	void *entry;
 	int ret;
 
-	if (!msg)
-		return -EINVAL;
-	ret = validate_message(msg);
-	if (ret)
+	if (desc->shadowed && desc->get_id && READ_ONCE(shadow_sets)) {
+		entry = xa_load(&sock->shadow, hsmp_shadow_index(msg->msg_id,
+								 arg & desc->key_mask));
+		if (entry && xa_to_value(entry) == arg)
+			return 0;
+	}
+
+	ret = __hsmp_send_message(sock, msg);
+	sock->stats.sent++;
+	if (ret == -ETIMEDOUT)
+		sock->stats.timedout++;
+	else if (ret)
+		sock->stats.failed++;
+	hsmp_shadow_update(sock, msg, arg, ret);
+	if (!ret) {
+		hsmp_set_cached(sock, msg);
+		hsmp_record_recent(sock, msg);
+	}
+
+	/* Learn the messages the firmware rejects as invalid */
+	if (ret == -ENOMSG)
+		clear_bit(msg->msg_id, sock->supported);
+
+	return ret;
+}
+
+/*
+ * Take the mailbox of a socket for a caller of the given priority class.
+ *
+ * The time taken by smu operation to complete is between
+ * 10us to 1ms. Sometime it may take more time.
+ * In SMP system timeout of 100 millisecs should
+ * be enough for the previous thread to finish the operation
+ *
+ * Only HIGH callers queue on the semaphore, so a HIGH caller waits at most
+ * for the current holder and the HIGH callers queued before it. LOW callers
+ * wait on lo_wq and take the semaphore with a trylock once no HIGH caller
+ * is queued, so that SET messages and in-kernel users do not sit behind a
+ * stream of monitoring GETs.
+ */
+static int __hsmp_sock_lock(struct hsmp_socket *sock, u32 prio)
+{
+	int ret;
+
+	if (prio == HSMP_PRIO_HIGH) {
+		atomic_inc(&sock->hi_waiters);
+		ret = down_timeout(&sock->hsmp_sem, msecs_to_jiffies(HSMP_MSG_TIMEOUT));
+		if (atomic_dec_and_test(&sock->hi_waiters))
+			wake_up_all(&sock->lo_wq);
 		return ret;
+	}
 
-	if (!plat_dev.sock || msg->sock_ind >= plat_dev.num_sockets)
+	if (!wait_event_timeout(sock->lo_wq,
+				!atomic_read(&sock->hi_waiters) &&
+				!down_trylock(&sock->hsmp_sem),
+				msecs_to_jiffies(HSMP_MSG_TIMEOUT)))
+		return -ETIME;
+
+	return 0;
+}
+
+/*
+ * The socket state outlives the device the socket is bound to, so files and
+ * in-kernel users may still reach a socket after its device was removed.
+ * Its mailbox is only accessed while bound.
+ */
+static int hsmp_sock_lock(struct hsmp_socket *sock, u32 prio)
+{
+	int ret;
+
+	ret = __hsmp_sock_lock(sock, prio);
+	if (ret < 0)
+		return ret;
+
+	if (READ_ONCE(sock->unbound)) {
+		hsmp_sock_unlock(sock);
 		return -ENODEV;
-	sock = &plat_dev.sock[msg->sock_ind];
+	}
 
-	/*
-	 * The time taken by smu operation to complete is between
-	 * 10us to 1ms. Sometime it may take more time.
-	 * In SMP system timeout of 100 millisecs should
-	 * be enough for the previous thread to finish the operation
-	 */
-	ret = down_timeout(&sock->hsmp_sem, msecs_to_jiffies(HSMP_MSG_TIMEOUT));
+	return 0;
+}
+
+static int __hsmp_sock_send(struct hsmp_socket *sock, struct hsmp_message *msg, u32 prio)
+{
+	int ret;
+
+	/* Reject messages the firmware does not implement without a round-trip */
+	if (!test_bit(msg->msg_id, sock->supported))
+		return -ENOMSG;
+
+	if (hsmp_get_cached(sock, msg) || hsmp_get_recent(sock, msg))
+		return 0;
+
+	ret = hsmp_sock_lock(sock, prio);
 	if (ret < 0)
 		return ret;
 
-	ret = __hsmp_send_message(sock, msg);
+	ret = hsmp_send_locked(sock, msg);
 
-	up(&sock->hsmp_sem);
+	hsmp_sock_unlock(sock);
+
+	return ret;
+}
+
+/* Send a validated message to a socket */
+static int hsmp_sock_send(struct hsmp_socket *sock, struct hsmp_message *msg, u32 prio)
+{
+	int ret;
+
+	trace_hsmp_msg_request(msg);
+	ret = __hsmp_sock_send(sock, msg, prio);
+	trace_hsmp_msg_complete(msg, ret);
 
 	return ret;
 }
+
+static int hsmp_send_message_prio(struct hsmp_message *msg, u32 prio)
+{
+	int ret;
+
+	if (!msg)
+		return -EINVAL;
+	ret = validate_message(msg);
+	if (ret)
+		return ret;
+
+	if (!plat_dev.sock || msg->sock_ind >= plat_dev.num_sockets)
+		return -ENODEV;
+
+	return hsmp_sock_send(plat_dev.sock[msg->sock_ind], msg, prio);
+}
+
+int hsmp_send_message(struct hsmp_message *msg)
+{
+	return hsmp_send_message_prio(msg, HSMP_PRIO_HIGH);
+}
 EXPORT_SYMBOL_GPL(hsmp_send_message);
 
 static int hsmp_test(u16 sock_ind, u32 value)
@@ -312,7 +1299,7 @@ static int hsmp_test(u16 sock_ind, u32 value)
 
 	/* Check the response value */
 	if (msg.args[0] != (value + 1)) {
-		dev_err(plat_dev.sock[sock_ind].dev,
+		dev_err(plat_dev.sock[sock_ind]->dev,
 			"Socket %d test message failed, Expected 0x%08X, received 0x%08X\n",
 			sock_ind, (value + 1), msg.args[0]);
 		return -EBADE;
@@ -321,20 +1308,90 @@ static int hsmp_test(u16 sock_ind, u32 value)
 	return ret;
 }
 
-static long hsmp_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+/*
+ * Context of an open file. tat_ns is the theoretical arrival time of the
+ * rate limiter, serialized by lock so that the threads sharing a limited
+ * file are paced one after the other. prio is the hsmp_prio_class of the
+ * messages.
+ */
+struct hsmp_file {
+	struct hsmp_socket *sock;
+	struct mutex lock;
+	u64 tat_ns;
+	u32 prio;
+};
+
+/* Socket a file was opened on, NULL for /dev/hsmp which serves all sockets */
+static struct hsmp_socket *hsmp_file_sock(struct file *fp)
 {
-	int __user *arguser = (int  __user *)arg;
-	struct hsmp_message msg = { 0 };
-	int ret;
+	struct hsmp_file *ctx = fp->private_data;
 
-	if (copy_struct_from_user(&msg, sizeof(msg), arguser, sizeof(struct hsmp_message)))
-		return -EFAULT;
+	return ctx->sock;
+}
 
-	/*
-	 * Check msg_id is within the range of supported msg ids
-	 * i.e within the array bounds of hsmp_msg_desc_table
-	 */
-	if (msg.msg_id < HSMP_TEST || msg.msg_id >= HSMP_MSG_ID_MAX)
+static u32 hsmp_file_prio(struct file *fp)
+{
+	struct hsmp_file *ctx = fp->private_data;
+
+	return READ_ONCE(ctx->prio);
+}
+
+/*
+ * Charge the messages about to be sent to the rate limit of a read-only
+ * file, sleeping until they fit in the budget of fd_rate messages per
+ * second with bursts of up to fd_burst. A request larger than a burst
+ * waits for a full burst and leaves the rest as debt for the next ones.
+ * Files open for writing are only available to root and not limited.
+ */
+static int hsmp_file_charge(struct file *fp, u32 cost)
+{
+	struct hsmp_file *ctx = fp->private_data;
+	u32 rate = READ_ONCE(fd_rate);
+	u32 burst = max(READ_ONCE(fd_burst), 1U);
+	u64 interval, now, tat, limit, fit;
+	int ret = 0;
+
+	if (!rate || (fp->f_mode & FMODE_WRITE))
+		return 0;
+
+	interval	= div_u64(NSEC_PER_SEC, rate);
+	fit		= min(cost, burst) * interval;
+
+	if (fp->f_flags & O_NONBLOCK) {
+		if (!mutex_trylock(&ctx->lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&ctx->lock)) {
+		return -ERESTARTSYS;
+	}
+
+	for (;;) {
+		now	= ktime_get_ns();
+		tat	= max(ctx->tat_ns, now);
+		limit	= now + burst * interval;
+		if (tat + fit <= limit)
+			break;
+
+		if (fp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+		if (msleep_interruptible(DIV_ROUND_UP_ULL(tat + fit - limit, NSEC_PER_MSEC))) {
+			ret = -ERESTARTSYS;
+			goto unlock;
+		}
+	}
+	ctx->tat_ns = tat + (u64)cost * interval;
+
+unlock:
+	mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+/* Check the message type against the mode the device was opened with */
+static int hsmp_check_fmode(struct file *fp, u32 msg_id)
+{
+	/* Not part of the protocol version, as validate_message() reports it */
+	if (plat_dev.msg_desc[msg_id].type == HSMP_RSVD)
 		return -ENOMSG;
 
 	switch (fp->f_mode & (FMODE_WRITE | FMODE_READ)) {
@@ -343,7 +1400,7 @@ static long hsmp_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 		 * Device is opened in O_WRONLY mode
 		 * Execute only set/configure commands
 		 */
-		if (hsmp_msg_desc_table[msg.msg_id].type != HSMP_SET)
+		if (plat_dev.msg_desc[msg_id].type != HSMP_SET)
 			return -EINVAL;
 		break;
 	case FMODE_READ:
@@ -351,7 +1408,7 @@ static long hsmp_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 		 * Device is opened in O_RDONLY mode
 		 * Execute only get/monitor commands
 		 */
-		if (hsmp_msg_desc_table[msg.msg_id].type != HSMP_GET)
+		if (plat_dev.msg_desc[msg_id].type != HSMP_GET)
 			return -EINVAL;
 		break;
 	case FMODE_READ | FMODE_WRITE:
@@ -364,11 +1421,46 @@ static long hsmp_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 		return -EINVAL;
 	}
 
-	ret = hsmp_send_message(&msg);
+	return 0;
+}
+
+static long hsmp_ioctl_msg(struct file *fp, void __user *arguser)
+{
+	struct hsmp_socket *sock = hsmp_file_sock(fp);
+	struct hsmp_message msg = { 0 };
+	int ret;
+
+	if (copy_struct_from_user(&msg, sizeof(msg), arguser, sizeof(struct hsmp_message)))
+		return -EFAULT;
+
+	/*
+	 * Check msg_id is within the range of supported msg ids
+	 * i.e within the array bounds of the descriptor tables
+	 */
+	if (msg.msg_id < HSMP_TEST || msg.msg_id >= HSMP_MSG_ID_MAX)
+		return -ENOMSG;
+
+	ret = hsmp_check_fmode(fp, msg.msg_id);
+	if (ret)
+		return ret;
+
+	ret = hsmp_file_charge(fp, 1);
+	if (ret)
+		return ret;
+
+	/* A socket device sends to its own socket whatever sock_ind says */
+	if (sock) {
+		msg.sock_ind = sock->sock_ind;
+		ret = validate_message(&msg);
+		if (!ret)
+			ret = hsmp_sock_send(sock, &msg, hsmp_file_prio(fp));
+	} else {
+		ret = hsmp_send_message_prio(&msg, hsmp_file_prio(fp));
+	}
 	if (ret)
 		return ret;
 
-	if (hsmp_msg_desc_table[msg.msg_id].response_sz > 0) {
+	if (plat_dev.msg_desc[msg.msg_id].response_sz > 0) {
 		/* Copy results back to user for get/monitor commands */
 		if (copy_to_user(arguser, &msg, sizeof(struct hsmp_message)))
 			return -EFAULT;
@@ -377,362 +1469,2055 @@ static long hsmp_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 	return 0;
 }
 
-static const struct file_operations hsmp_fops = {
-	.owner		= THIS_MODULE,
-	.unlocked_ioctl	= hsmp_ioctl,
-	.compat_ioctl	= hsmp_ioctl,
-};
-
-/* This is the UUID used for HSMP */
-static const guid_t acpi_hsmp_uuid = GUID_INIT(0xb74d619d, 0x5707, 0x48bd,
-						0xa6, 0x9f, 0x4e, 0xa2,
-						0x87, 0x1f, 0xc2, 0xf6);
-
-static inline bool is_acpi_hsmp_uuid(union acpi_object *obj)
+/*
+ * Resolve the socket index and APIC ID of a logical CPU.
+ * The caller is expected to hold cpus_read_lock() if the result
+ * has to stay valid across CPU hotplug.
+ */
+static int hsmp_cpu_to_sock(unsigned int cpu, u16 *sock_ind, u32 *apicid)
 {
-	if (obj->type == ACPI_TYPE_BUFFER && obj->buffer.length == UUID_SIZE)
-		return guid_equal((guid_t *)obj->buffer.pointer, &acpi_hsmp_uuid);
+	int pkg;
 
-	return false;
-}
+	if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return -ENODEV;
 
-static inline int hsmp_get_uid(struct device *dev, u16 *sock_ind)
-{
-	char *uid;
+	pkg = topology_logical_package_id(cpu);
+	if (pkg < 0 || pkg >= plat_dev.num_sockets)
+		return -ENODEV;
 
-	/*
-	 * UID (ID00, ID01..IDXX) is used for differentiating sockets,
-	 * read it and strip the "ID" part of it and convert the remaining
-	 * bytes to integer.
-	 */
-	uid = acpi_device_uid(ACPI_COMPANION(dev));
+	*sock_ind	= pkg;
+	*apicid		= per_cpu(x86_cpu_to_apicid, cpu);
 
-	return kstrtou16(uid + 2, 10, sock_ind);
+	return 0;
 }
 
-static acpi_status hsmp_resource(struct acpi_resource *res, void *data)
+/*
+ * Send a per-core message keyed by logical CPU number, without holding the
+ * CPU hotplug lock. Used from the per-CPU sysfs files, whose removal on CPU
+ * offline runs with the hotplug lock held.
+ */
+static int __hsmp_send_cpu_message(u32 msg_id, unsigned int cpu, u32 *value, u32 prio)
 {
-	struct hsmp_socket *sock = data;
-	struct resource r;
+	struct hsmp_message msg = { 0 };
+	u16 sock_ind;
+	u32 apicid;
+	int ret;
 
-	switch (res->type) {
-	case ACPI_RESOURCE_TYPE_FIXED_MEMORY32:
-		if (!acpi_dev_resource_memory(res, &r))
-			return AE_ERROR;
-		if (!r.start || r.end < r.start || !(r.flags & IORESOURCE_MEM_WRITEABLE))
-			return AE_ERROR;
-		sock->mbinfo.base_addr = r.start;
-		sock->mbinfo.size = resource_size(&r);
-		break;
-	case ACPI_RESOURCE_TYPE_END_TAG:
+	if (!value)
+		return -EINVAL;
+
+	switch (msg_id) {
+	case HSMP_SET_BOOST_LIMIT:
+	case HSMP_GET_BOOST_LIMIT:
+	case HSMP_GET_CCLK_CORE_LIMIT:
 		break;
 	default:
-		return AE_ERROR;
+		return -EINVAL;
 	}
 
-	return AE_OK;
+	ret = hsmp_cpu_to_sock(cpu, &sock_ind, &apicid);
+	if (ret)
+		return ret;
+
+	msg.msg_id	= msg_id;
+	msg.num_args	= plat_dev.msg_desc[msg_id].num_args;
+	msg.response_sz	= plat_dev.msg_desc[msg_id].response_sz;
+	msg.sock_ind	= sock_ind;
+
+	if (msg_id == HSMP_SET_BOOST_LIMIT) {
+		/* apic id[31:16] + boost limit value in MHz[15:0] */
+		if (apicid > U16_MAX || *value > U16_MAX)
+			return -EINVAL;
+		msg.args[0] = (apicid << 16) | *value;
+	} else {
+		msg.args[0] = apicid;
+	}
+
+	ret = hsmp_send_message_prio(&msg, prio);
+	if (!ret && msg.response_sz)
+		*value = msg.args[0];
+
+	return ret;
 }
 
-static int hsmp_read_acpi_dsd(struct hsmp_socket *sock)
+/*
+ * Send a per-core message keyed by logical CPU number.
+ * The driver resolves the socket and the APIC ID of the CPU.
+ *
+ * HSMP_SET_BOOST_LIMIT takes the boost limit in MHz in *value,
+ * HSMP_GET_BOOST_LIMIT and HSMP_GET_CCLK_CORE_LIMIT return the limit
+ * in MHz in *value.
+ */
+int hsmp_send_cpu_message(u32 msg_id, unsigned int cpu, u32 *value)
 {
-	struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
-	union acpi_object *guid, *mailbox_package;
-	union acpi_object *dsd;
-	acpi_status status;
-	int ret = 0;
-	int j;
+	int ret;
 
-	status = acpi_evaluate_object_typed(ACPI_HANDLE(sock->dev), "_DSD", NULL,
-					    &buf, ACPI_TYPE_PACKAGE);
-	if (ACPI_FAILURE(status)) {
-		dev_err(sock->dev, "Failed to read mailbox reg offsets from DSD table, err: %s\n",
-			acpi_format_exception(status));
-		return -ENODEV;
-	}
+	cpus_read_lock();
+	ret = __hsmp_send_cpu_message(msg_id, cpu, value, HSMP_PRIO_HIGH);
+	cpus_read_unlock();
 
-	dsd = buf.pointer;
+	return ret;
+}
+EXPORT_SYMBOL_GPL(hsmp_send_cpu_message);
 
-	/* HSMP _DSD property should contain 2 objects.
-	 * 1. guid which is an acpi object of type ACPI_TYPE_BUFFER
-	 * 2. mailbox which is an acpi object of type ACPI_TYPE_PACKAGE
-	 *    This mailbox object contains 3 more acpi objects of type
-	 *    ACPI_TYPE_PACKAGE for holding msgid, msgresp, msgarg offsets
-	 *    these packages inturn contain 2 acpi objects of type
-	 *    ACPI_TYPE_STRING and ACPI_TYPE_INTEGER
-	 */
-	if (!dsd || dsd->type != ACPI_TYPE_PACKAGE || dsd->package.count != 2) {
-		ret = -EINVAL;
-		goto free_buf;
-	}
+/*
+ * The limits are per core, SMT siblings share them. The lowest numbered
+ * online sibling of a core queries it for all of them.
+ */
+static bool hsmp_core_leader(unsigned int cpu)
+{
+	return cpumask_first_and(topology_sibling_cpumask(cpu), cpu_online_mask) == cpu;
+}
 
-	guid = &dsd->package.elements[0];
-	mailbox_package = &dsd->package.elements[1];
-	if (!is_acpi_hsmp_uuid(guid) || mailbox_package->type != ACPI_TYPE_PACKAGE) {
-		dev_err(sock->dev, "Invalid hsmp _DSD table data\n");
-		ret = -EINVAL;
-		goto free_buf;
+/* Messages hsmp_get_sock_core_limits() sends for the sockets first to last - 1 */
+static u32 hsmp_core_limits_cost(u16 first, u16 last, u32 num_cpus)
+{
+	unsigned int cpu;
+	u16 cpu_sock;
+	u32 apicid;
+	u32 cost = 0;
+
+	for_each_online_cpu(cpu) {
+		if (cpu >= num_cpus)
+			break;
+		if (hsmp_core_leader(cpu) && !hsmp_cpu_to_sock(cpu, &cpu_sock, &apicid) &&
+		    cpu_sock >= first && cpu_sock < last)
+			cost++;
 	}
 
-	for (j = 0; j < mailbox_package->package.count; j++) {
-		union acpi_object *msgobj, *msgstr, *msgint;
+	return cost;
+}
 
-		msgobj	= &mailbox_package->package.elements[j];
-		msgstr	= &msgobj->package.elements[0];
-		msgint	= &msgobj->package.elements[1];
+/*
+ * Read the per-core limit selected by msg_id for every online CPU of one
+ * socket whose logical CPU number is below num_cpus. The socket is locked
+ * once for all its cores and only handed over to high priority callers
+ * waiting for it between two cores.
+ */
+static int hsmp_get_sock_core_limits(u16 sock_ind, u32 msg_id,
+				     u32 *limits, u32 num_cpus, u32 prio)
+{
+	struct hsmp_socket *sock = plat_dev.sock[sock_ind];
+	struct hsmp_message msg = { 0 };
+	unsigned int cpu, sibling;
+	u16 cpu_sock;
+	u32 apicid;
+	int ret;
 
-		/* package should have 1 string and 1 integer object */
-		if (msgobj->type != ACPI_TYPE_PACKAGE ||
-		    msgstr->type != ACPI_TYPE_STRING ||
-		    msgint->type != ACPI_TYPE_INTEGER) {
-			ret = -EINVAL;
-			goto free_buf;
+	msg.msg_id	= msg_id;
+	msg.num_args	= plat_dev.msg_desc[msg_id].num_args;
+	msg.response_sz	= plat_dev.msg_desc[msg_id].response_sz;
+	msg.sock_ind	= sock_ind;
+
+	ret = hsmp_sock_lock(sock, prio);
+	if (ret < 0)
+		return ret;
+
+	for_each_online_cpu(cpu) {
+		if (cpu >= num_cpus)
+			break;
+		if (!hsmp_core_leader(cpu) ||
+		    hsmp_cpu_to_sock(cpu, &cpu_sock, &apicid) || cpu_sock != sock_ind)
+			continue;
+
+		if (atomic_read(&sock->hi_waiters)) {
+			hsmp_sock_unlock(sock);
+			ret = hsmp_sock_lock(sock, prio);
+			if (ret < 0)
+				return ret;
 		}
 
-		if (!strncmp(msgstr->string.pointer, MSG_IDOFF_STR,
-			     msgstr->string.length)) {
-			sock->mbinfo.msg_id_off = msgint->integer.value;
-		} else if (!strncmp(msgstr->string.pointer, MSG_RESPOFF_STR,
-				    msgstr->string.length)) {
-			sock->mbinfo.msg_resp_off =  msgint->integer.value;
-		} else if (!strncmp(msgstr->string.pointer, MSG_ARGOFF_STR,
-				    msgstr->string.length)) {
-			sock->mbinfo.msg_arg_off = msgint->integer.value;
-		} else {
-			ret = -ENOENT;
-			goto free_buf;
+		msg.args[0] = apicid;
+		trace_hsmp_msg_request(&msg);
+		ret = hsmp_send_locked(sock, &msg);
+		trace_hsmp_msg_complete(&msg, ret);
+		if (ret)
+			break;
+
+		for_each_cpu_and(sibling, topology_sibling_cpumask(cpu), cpu_online_mask) {
+			if (sibling < num_cpus)
+				limits[sibling] = msg.args[0];
 		}
 	}
 
-	if (!sock->mbinfo.msg_id_off || !sock->mbinfo.msg_resp_off ||
-	    !sock->mbinfo.msg_arg_off)
-		ret = -EINVAL;
+	hsmp_sock_unlock(sock);
 
-free_buf:
-	ACPI_FREE(buf.pointer);
 	return ret;
 }
 
-static int hsmp_read_acpi_crs(struct hsmp_socket *sock)
+static long hsmp_ioctl_core_limits(struct file *fp, void __user *arguser)
 {
-	acpi_status status;
+	struct hsmp_socket *sock = hsmp_file_sock(fp);
+	u16 first = 0, last = plat_dev.num_sockets;
+	struct hsmp_core_limits req;
+	u32 num_cpus, *limits;
+	int ret = 0;
+	u16 i;
 
-	status = acpi_walk_resources(ACPI_HANDLE(sock->dev), METHOD_NAME__CRS,
-				     hsmp_resource, sock);
-	if (ACPI_FAILURE(status)) {
-		dev_err(sock->dev, "Failed to look up MP1 base address from CRS method, err: %s\n",
-			acpi_format_exception(status));
+	if (!(fp->f_mode & FMODE_READ))
 		return -EINVAL;
-	}
-	if (!sock->mbinfo.base_addr || !sock->mbinfo.size)
+
+	if (copy_from_user(&req, arguser, sizeof(req)))
+		return -EFAULT;
+
+	if (req.msg_id != HSMP_GET_CCLK_CORE_LIMIT && req.msg_id != HSMP_GET_BOOST_LIMIT)
 		return -EINVAL;
 
-	/* The mapped region should be un cached */
-	sock->virt_base_addr = devm_ioremap_uc(sock->dev, sock->mbinfo.base_addr,
-					       sock->mbinfo.size);
-	if (!sock->virt_base_addr) {
-		dev_err(sock->dev, "Failed to ioremap MP1 base address\n");
+	num_cpus = min_t(u32, req.num_cpus, nr_cpu_ids);
+	if (!num_cpus)
+		return -EINVAL;
+
+	/* A socket device only fills in the cores of its socket */
+	if (sock) {
+		first	= sock->sock_ind;
+		last	= first + 1;
+	}
+
+	ret = hsmp_file_charge(fp, hsmp_core_limits_cost(first, last, num_cpus));
+	if (ret)
+		return ret;
+
+	limits = kvcalloc(num_cpus, sizeof(*limits), GFP_KERNEL);
+	if (!limits)
 		return -ENOMEM;
+
+	/* One message per core, keep the topology stable meanwhile */
+	cpus_read_lock();
+	for (i = first; i < last; i++) {
+		ret = hsmp_get_sock_core_limits(i, req.msg_id, limits, num_cpus,
+						hsmp_file_prio(fp));
+		if (ret)
+			break;
 	}
+	cpus_read_unlock();
+	if (ret)
+		goto free_limits;
 
-	return 0;
+	req.num_cpus = num_cpus;
+	if (copy_to_user(u64_to_user_ptr(req.limits), limits, num_cpus * sizeof(*limits)) ||
+	    copy_to_user(arguser, &req, sizeof(req)))
+		ret = -EFAULT;
+
+free_limits:
+	kvfree(limits);
+	return ret;
 }
 
-/* Parse the ACPI table to read the data */
-static int hsmp_parse_acpi_table(struct device *dev, u16 sock_ind)
+static long hsmp_ioctl_cpu_msg(struct file *fp, void __user *arguser)
 {
-	struct hsmp_socket *sock = &plat_dev.sock[sock_ind];
+	struct hsmp_socket *sock;
+	struct hsmp_cpu_message req;
 	int ret;
 
-	sock->sock_ind		= sock_ind;
-	sock->dev		= dev;
-	plat_dev.is_acpi_device	= true;
+	if (copy_from_user(&req, arguser, sizeof(req)))
+		return -EFAULT;
 
-	sema_init(&sock->hsmp_sem, 1);
+	if (req.msg_id < HSMP_TEST || req.msg_id >= HSMP_MSG_ID_MAX)
+		return -ENOMSG;
 
-	/* Read MP1 base address from CRS method */
-	ret = hsmp_read_acpi_crs(sock);
+	ret = hsmp_check_fmode(fp, req.msg_id);
 	if (ret)
 		return ret;
 
-	/* Read mailbox offsets from DSD table */
-	return hsmp_read_acpi_dsd(sock);
+	sock = hsmp_file_sock(fp);
+	if (sock && (req.cpu >= nr_cpu_ids ||
+		     topology_logical_package_id(req.cpu) != sock->sock_ind))
+		return -EINVAL;
+
+	ret = hsmp_file_charge(fp, 1);
+	if (ret)
+		return ret;
+
+	cpus_read_lock();
+	ret = __hsmp_send_cpu_message(req.msg_id, req.cpu, &req.value, hsmp_file_prio(fp));
+	cpus_read_unlock();
+	if (ret)
+		return ret;
+
+	if (plat_dev.msg_desc[req.msg_id].response_sz > 0) {
+		if (copy_to_user(arguser, &req, sizeof(req)))
+			return -EFAULT;
+	}
+
+	return 0;
 }
 
-static ssize_t hsmp_metric_tbl_read(struct file *filp, struct kobject *kobj,
-				    struct bin_attribute *bin_attr, char *buf,
-				    loff_t off, size_t count)
+static inline bool hsmp_txn_restorable(u32 msg_id)
 {
-	struct hsmp_socket *sock = bin_attr->private;
-	struct hsmp_message msg = { 0 };
-	int ret;
+	return hsmp_set_desc_table[msg_id].get_id != 0;
+}
 
-	if (!sock)
-		return -EINVAL;
+/*
+ * Previous value of a SET message without a readback: the argument last
+ * applied through the driver, if the shadow holds one.
+ */
+static bool hsmp_txn_shadowed(struct hsmp_socket *sock, struct hsmp_message *msg, u32 *saved)
+{
+	const struct hsmp_set_desc *desc = &hsmp_set_desc_table[msg->msg_id];
+	void *entry;
 
-	/* Do not support lseek(), reads entire metric table */
-	if (count < bin_attr->size) {
-		dev_err(sock->dev, "Wrong buffer size\n");
-		return -EINVAL;
-	}
+	if (!desc->shadowed)
+		return false;
 
-	msg.msg_id	= HSMP_GET_METRIC_TABLE;
-	msg.sock_ind	= sock->sock_ind;
+	entry = xa_load(&sock->shadow, hsmp_shadow_index(msg->msg_id,
+							 msg->args[0] & desc->key_mask));
+	if (!entry)
+		return false;
 
-	ret = hsmp_send_message(&msg);
-	if (ret)
-		return ret;
-	memcpy_fromio(buf, sock->metric_tbl_addr, bin_attr->size);
+	*saved = xa_to_value(entry);
 
-	return bin_attr->size;
+	return true;
 }
 
-static int hsmp_get_tbl_dram_base(u16 sock_ind)
+static int hsmp_txn_save(struct hsmp_socket *sock, struct hsmp_message *msg, u32 *saved)
 {
-	struct hsmp_socket *sock = &plat_dev.sock[sock_ind];
-	struct hsmp_message msg = { 0 };
-	phys_addr_t dram_addr;
+	const struct hsmp_set_desc *rst = &hsmp_set_desc_table[msg->msg_id];
+	struct hsmp_message get = { 0 };
 	int ret;
 
-	msg.sock_ind	= sock_ind;
-	msg.response_sz	= hsmp_msg_desc_table[HSMP_GET_METRIC_TABLE_DRAM_ADDR].response_sz;
-	msg.msg_id	= HSMP_GET_METRIC_TABLE_DRAM_ADDR;
+	get.msg_id	= rst->get_id;
+	get.num_args	= plat_dev.msg_desc[rst->get_id].num_args;
+	get.response_sz	= plat_dev.msg_desc[rst->get_id].response_sz;
+	get.sock_ind	= msg->sock_ind;
+	get.args[0]	= (msg->args[0] & rst->key_mask) >> rst->key_shift;
 
-	ret = hsmp_send_message(&msg);
+	ret = hsmp_send_locked(sock, &get);
 	if (ret)
 		return ret;
 
-	/*
-	 * calculate the metric table DRAM address from lower and upper 32 bits
-	 * sent from SMU and ioremap it to virtual address.
-	 */
-	dram_addr = msg.args[0] | ((u64)(msg.args[1]) << 32);
-	if (!dram_addr) {
-		dev_err(sock->dev, "Invalid DRAM address for metric table\n");
-		return -ENOMEM;
-	}
-	sock->metric_tbl_addr = devm_ioremap(sock->dev, dram_addr,
-					     sizeof(struct hsmp_metric_table));
-	if (!sock->metric_tbl_addr) {
-		dev_err(sock->dev, "Failed to ioremap metric table addr\n");
-		return -ENOMEM;
-	}
+	*saved = (msg->args[0] & rst->key_mask) | (get.args[0] & rst->val_mask);
+
 	return 0;
 }
 
-static umode_t hsmp_is_sock_attr_visible(struct kobject *kobj,
-					 struct bin_attribute *battr, int id)
+/* Undo the SET messages with a saved value before index count, in reverse order */
+static void hsmp_txn_rollback(struct hsmp_socket *sock, struct hsmp_txn *txn,
+			      u32 *saved, u32 restore, int count)
 {
-	if (plat_dev.proto_ver == HSMP_PROTO_VER6)
-		return battr->attr.mode;
-	else
-		return 0;
+	struct hsmp_message msg;
+
+	while (--count >= 0) {
+		if (!(restore & BIT(count)))
+			continue;
+
+		msg		= txn->msgs[count];
+		msg.args[0]	= saved[count];
+		if (hsmp_send_locked(sock, &msg))
+			dev_err(sock->dev, "Socket %u failed to restore message ID %u\n",
+				sock->sock_ind, msg.msg_id);
+	}
 }
 
-static int hsmp_init_metric_tbl_bin_attr(struct bin_attribute **hattrs, u16 sock_ind)
+static int hsmp_txn_validate(struct file *fp, struct hsmp_txn *txn)
 {
-	struct bin_attribute *hattr = &plat_dev.sock[sock_ind].hsmp_attr;
+	int i, ret;
 
-	sysfs_bin_attr_init(hattr);
-	hattr->attr.name	= HSMP_METRICS_TABLE_NAME;
-	hattr->attr.mode	= 0444;
-	hattr->read		= hsmp_metric_tbl_read;
-	hattr->size		= sizeof(struct hsmp_metric_table);
-	hattr->private		= &plat_dev.sock[sock_ind];
-	hattrs[0]		= hattr;
+	if (!txn->num_msgs || txn->num_msgs > HSMP_MAX_TXN_MSGS)
+		return -EINVAL;
 
-	if (plat_dev.proto_ver == HSMP_PROTO_VER6)
-		return hsmp_get_tbl_dram_base(sock_ind);
-	else
-		return 0;
-}
+	if (!plat_dev.sock || txn->sock_ind >= plat_dev.num_sockets)
+		return -ENODEV;
 
-/* One bin sysfs for metrics table */
-#define NUM_HSMP_ATTRS		1
+	for (i = 0; i < txn->num_msgs; i++) {
+		struct hsmp_message *msg = &txn->msgs[i];
 
-static int hsmp_create_attr_list(struct attribute_group *attr_grp,
-				 struct device *dev, u16 sock_ind)
+		msg->sock_ind = txn->sock_ind;
+		ret = validate_message(msg);
+		if (ret)
+			return ret;
+		ret = hsmp_check_fmode(fp, msg->msg_id);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Run all messages of the transaction with the socket locked. The values
+ * changed by the SET messages are read back first, if any message fails the
+ * previous ones are restored and failed_ind holds the index of the failure.
+ *
+ * A SET message without a readback is restored to the value last applied
+ * through the driver, taken from the shadow before anything is sent. If the
+ * shadow has none, it can only be the last message, as a failure later in
+ * the sequence could not be undone.
+ */
+static int hsmp_send_txn(struct hsmp_txn *txn, u32 prio)
+{
+	struct hsmp_socket *sock = plat_dev.sock[txn->sock_ind];
+	u32 saved[HSMP_MAX_TXN_MSGS];
+	struct hsmp_message *msg;
+	u32 restore = 0;
+	int i, ret;
+
+	ret = hsmp_sock_lock(sock, prio);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < txn->num_msgs; i++) {
+		msg = &txn->msgs[i];
+
+		if (plat_dev.msg_desc[msg->msg_id].type != HSMP_SET ||
+		    hsmp_txn_restorable(msg->msg_id))
+			continue;
+
+		if (hsmp_txn_shadowed(sock, msg, &saved[i])) {
+			restore |= BIT(i);
+		} else if (i != txn->num_msgs - 1) {
+			txn->failed_ind = i;
+			ret = -EINVAL;
+			goto unlock;
+		}
+	}
+
+	for (i = 0; i < txn->num_msgs; i++) {
+		msg = &txn->msgs[i];
+
+		if (plat_dev.msg_desc[msg->msg_id].type == HSMP_SET &&
+		    hsmp_txn_restorable(msg->msg_id)) {
+			ret = hsmp_txn_save(sock, msg, &saved[i]);
+			if (ret)
+				break;
+			restore |= BIT(i);
+		}
+
+		trace_hsmp_msg_request(msg);
+		ret = hsmp_send_locked(sock, msg);
+		trace_hsmp_msg_complete(msg, ret);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		txn->failed_ind = i;
+		hsmp_txn_rollback(sock, txn, saved, restore, i);
+	}
+
+unlock:
+	hsmp_sock_unlock(sock);
+
+	return ret;
+}
+
+static long hsmp_ioctl_txn(struct file *fp, void __user *arguser)
+{
+	struct hsmp_socket *sock = hsmp_file_sock(fp);
+	struct hsmp_txn *txn;
+	int ret;
+
+	txn = memdup_user(arguser, sizeof(*txn));
+	if (IS_ERR(txn))
+		return PTR_ERR(txn);
+
+	if (sock)
+		txn->sock_ind = sock->sock_ind;
+
+	txn->failed_ind = txn->num_msgs;
+	ret = hsmp_txn_validate(fp, txn);
+	if (!ret)
+		ret = hsmp_file_charge(fp, txn->num_msgs);
+	if (!ret)
+		ret = hsmp_send_txn(txn, hsmp_file_prio(fp));
+
+	/* Copy back the GET responses or the index of the failed message */
+	if (copy_to_user(arguser, txn, sizeof(*txn)))
+		ret = -EFAULT;
+
+	kfree(txn);
+	return ret;
+}
+
+static long hsmp_ioctl_batch(struct file *fp, void __user *arguser)
+{
+	struct hsmp_socket *sock = hsmp_file_sock(fp);
+	struct hsmp_message *msgs, *msg;
+	struct hsmp_batch req;
+	int ret = 0;
+
+	if (copy_from_user(&req, arguser, sizeof(req)))
+		return -EFAULT;
+
+	if (!req.num_msgs || req.num_msgs > HSMP_MAX_BATCH_MSGS)
+		return -EINVAL;
+
+	msgs = vmemdup_user(u64_to_user_ptr(req.msgs), array_size(req.num_msgs, sizeof(*msgs)));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+
+	for (req.done = 0; req.done < req.num_msgs; req.done++) {
+		msg = &msgs[req.done];
+
+		if (msg->msg_id < HSMP_TEST || msg->msg_id >= HSMP_MSG_ID_MAX) {
+			ret = -ENOMSG;
+			break;
+		}
+		ret = hsmp_check_fmode(fp, msg->msg_id);
+		if (ret)
+			break;
+		ret = hsmp_file_charge(fp, 1);
+		if (ret)
+			break;
+
+		if (sock) {
+			msg->sock_ind = sock->sock_ind;
+			ret = validate_message(msg);
+			if (!ret)
+				ret = hsmp_sock_send(sock, msg, hsmp_file_prio(fp));
+		} else {
+			ret = hsmp_send_message_prio(msg, hsmp_file_prio(fp));
+		}
+		if (ret)
+			break;
+	}
+
+	/* Copy back the responses of the completed messages */
+	if ((req.done && copy_to_user(u64_to_user_ptr(req.msgs), msgs,
+				      req.done * sizeof(*msgs))) ||
+	    copy_to_user(arguser, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	kvfree(msgs);
+	return ret;
+}
+
+static int hsmp_sample_validate(struct file *fp, struct hsmp_sample_req *req)
+{
+	int i, ret;
+
+	if (!req->num_msgs || req->num_msgs > HSMP_MAX_SAMPLE_MSGS ||
+	    !req->num_samples || req->num_samples > HSMP_MAX_SAMPLES ||
+	    !req->interval_us)
+		return -EINVAL;
+
+	if ((u64)req->num_samples * req->interval_us > HSMP_MAX_SAMPLE_MS * USEC_PER_MSEC)
+		return -EINVAL;
+
+	if (!plat_dev.sock || req->sock_ind >= plat_dev.num_sockets)
+		return -ENODEV;
+
+	for (i = 0; i < req->num_msgs; i++) {
+		struct hsmp_message *msg = &req->msgs[i];
+
+		msg->sock_ind = req->sock_ind;
+		ret = validate_message(msg);
+		if (ret)
+			return ret;
+		ret = hsmp_check_fmode(fp, msg->msg_id);
+		if (ret)
+			return ret;
+
+		if (plat_dev.msg_desc[msg->msg_id].type != HSMP_GET || msg->response_sz != 1)
+			return -EINVAL;
+		if (!test_bit(msg->msg_id, plat_dev.sock[req->sock_ind]->supported))
+			return -ENOMSG;
+	}
+
+	return 0;
+}
+
+/*
+ * Take samples of a socket. Rows are timed against absolute hrtimer
+ * deadlines so that late wakeups do not accumulate. The socket is locked
+ * for one row at a time and never held across the sleep between rows, so
+ * that other callers are not held off for a whole series.
+ */
+static int hsmp_send_samples(struct hsmp_socket *sock, struct hsmp_sample_req *req,
+			     struct hsmp_sample *samples, u32 prio)
+{
+	struct hsmp_message msg;
+	ktime_t next, end;
+	u32 i, j;
+	int ret = 0;
+
+	next = ktime_get();
+	end = ktime_add_us(next, HSMP_MAX_SAMPLE_MS * USEC_PER_MSEC);
+	for (i = 0; i < req->num_samples; i++) {
+		if (i) {
+			next = ktime_add_us(next, req->interval_us);
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout_range(&next, 0, HRTIMER_MODE_ABS);
+			if (signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+
+			/* Waits for the socket must not stretch the series */
+			if (ktime_after(ktime_get(), end))
+				break;
+		}
+
+		ret = hsmp_sock_lock(sock, prio);
+		if (ret < 0)
+			break;
+
+		samples[i].stamp_ns = ktime_get_ns();
+		for (j = 0; j < req->num_msgs; j++) {
+			/* The response overwrites the arguments, send a copy */
+			msg = req->msgs[j];
+			trace_hsmp_msg_request(&msg);
+			ret = hsmp_send_locked(sock, &msg);
+			trace_hsmp_msg_complete(&msg, ret);
+			if (ret)
+				break;
+			samples[i].resp[j] = msg.args[0];
+		}
+		hsmp_sock_unlock(sock);
+		if (ret)
+			break;
+	}
+	req->num_samples = i;
+
+	return ret;
+}
+
+static long hsmp_ioctl_sample(struct file *fp, void __user *arguser)
+{
+	struct hsmp_socket *sock = hsmp_file_sock(fp);
+	struct hsmp_sample *samples;
+	struct hsmp_sample_req *req;
+	int ret;
+
+	req = memdup_user(arguser, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (sock)
+		req->sock_ind = sock->sock_ind;
+
+	ret = hsmp_sample_validate(fp, req);
+	if (ret)
+		goto free_req;
+
+	ret = hsmp_file_charge(fp, req->num_samples * req->num_msgs);
+	if (ret)
+		goto free_req;
+
+	samples = kvcalloc(req->num_samples, sizeof(*samples), GFP_KERNEL);
+	if (!samples) {
+		ret = -ENOMEM;
+		goto free_req;
+	}
+
+	ret = hsmp_send_samples(plat_dev.sock[req->sock_ind], req, samples,
+				hsmp_file_prio(fp));
+
+	/* Copy back the rows taken, also after a failure */
+	if ((req->num_samples &&
+	     copy_to_user(u64_to_user_ptr(req->samples), samples,
+			  req->num_samples * sizeof(*samples))) ||
+	    copy_to_user(arguser, req, sizeof(*req)))
+		ret = -EFAULT;
+
+	kvfree(samples);
+free_req:
+	kfree(req);
+	return ret;
+}
+
+static long hsmp_ioctl_set_prio(struct file *fp, void __user *arguser)
+{
+	struct hsmp_file *ctx = fp->private_data;
+	u32 prio;
+
+	if (get_user(prio, (u32 __user *)arguser))
+		return -EFAULT;
+
+	if (prio != HSMP_PRIO_LOW && prio != HSMP_PRIO_HIGH)
+		return -EINVAL;
+
+	/* Anyone may step aside, only the admin may cut the queue */
+	if (prio > READ_ONCE(ctx->prio) && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	WRITE_ONCE(ctx->prio, prio);
+
+	return 0;
+}
+
+static long hsmp_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+{
+	void __user *arguser = (void __user *)arg;
+	long ret;
+
+	switch (cmd) {
+	case HSMP_IOCTL_CMD:
+		ret = hsmp_ioctl_msg(fp, arguser);
+		break;
+	case HSMP_IOCTL_CORE_LIMITS:
+		ret = hsmp_ioctl_core_limits(fp, arguser);
+		break;
+	case HSMP_IOCTL_CPU_CMD:
+		ret = hsmp_ioctl_cpu_msg(fp, arguser);
+		break;
+	case HSMP_IOCTL_TXN:
+		ret = hsmp_ioctl_txn(fp, arguser);
+		break;
+	case HSMP_IOCTL_BATCH:
+		ret = hsmp_ioctl_batch(fp, arguser);
+		break;
+	case HSMP_IOCTL_SET_PRIO:
+		ret = hsmp_ioctl_set_prio(fp, arguser);
+		break;
+	case HSMP_IOCTL_SAMPLE:
+		ret = hsmp_ioctl_sample(fp, arguser);
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+
+	return ret;
+}
+
+static int hsmp_file_open(struct file *fp, struct hsmp_socket *sock)
+{
+	struct hsmp_file *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->sock = sock;
+	ctx->prio = (fp->f_mode & FMODE_WRITE) ? HSMP_PRIO_HIGH : HSMP_PRIO_LOW;
+	mutex_init(&ctx->lock);
+	fp->private_data = ctx;
+
+	return 0;
+}
+
+static int hsmp_open(struct inode *inode, struct file *fp)
+{
+	return hsmp_file_open(fp, NULL);
+}
+
+static int hsmp_release(struct inode *inode, struct file *fp)
+{
+	struct hsmp_file *ctx = fp->private_data;
+
+	mutex_destroy(&ctx->lock);
+	kfree(ctx);
+
+	return 0;
+}
+
+/* GET messages refreshed in the shared page of a socket while it is mapped */
+static const u32 hsmp_refresh_msgs[] = {
+	HSMP_GET_SOCKET_POWER,
+	HSMP_GET_TEMP_MONITOR,
+	HSMP_GET_C0_PERCENT,
+};
+
+static void hsmp_refresh_work(struct work_struct *work)
+{
+	struct hsmp_socket *sock = container_of(to_delayed_work(work),
+						struct hsmp_socket, refresh);
+	u32 interval_ms = READ_ONCE(shared_refresh_ms);
+	struct hsmp_message msg = { 0 };
+	int i;
+
+	if (!interval_ms || !atomic_read(&sock->mappers) || READ_ONCE(sock->unbound))
+		return;
+
+	/* Low priority, the refresh must not delay SET messages */
+	for (i = 0; i < ARRAY_SIZE(hsmp_refresh_msgs); i++) {
+		msg.msg_id	= hsmp_refresh_msgs[i];
+		msg.response_sz	= plat_dev.msg_desc[msg.msg_id].response_sz;
+		msg.sock_ind	= sock->sock_ind;
+		hsmp_sock_send(sock, &msg, HSMP_PRIO_LOW);
+	}
+
+	queue_delayed_work(system_wq, &sock->refresh, msecs_to_jiffies(interval_ms));
+}
+
+static void hsmp_shared_vm_open(struct vm_area_struct *vma)
+{
+	struct hsmp_socket *sock = vma->vm_private_data;
+
+	if (atomic_inc_return(&sock->mappers) == 1 && READ_ONCE(shared_refresh_ms) &&
+	    !READ_ONCE(sock->unbound))
+		queue_delayed_work(system_wq, &sock->refresh, 0);
+}
+
+static void hsmp_shared_vm_close(struct vm_area_struct *vma)
+{
+	struct hsmp_socket *sock = vma->vm_private_data;
+
+	atomic_dec(&sock->mappers);
+}
+
+static const struct vm_operations_struct hsmp_shared_vm_ops = {
+	.open	= hsmp_shared_vm_open,
+	.close	= hsmp_shared_vm_close,
+};
+
+/*
+ * Map the shared page of a socket read-only. /dev/hsmp selects the socket
+ * with the page offset, a socket device only maps its own page at offset 0.
+ *
+ * The mapping holds the file and so the module, which keeps the socket
+ * referenced by vm_private_data alive. Once the socket is unbound the page
+ * is no longer refreshed and new mappings are refused.
+ */
+static int hsmp_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	struct hsmp_socket *sock = hsmp_file_sock(fp);
+	int ret;
+
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	if (!sock) {
+		if (!plat_dev.sock || vma->vm_pgoff >= plat_dev.num_sockets)
+			return -EINVAL;
+		sock = plat_dev.sock[vma->vm_pgoff];
+	} else if (vma->vm_pgoff) {
+		return -EINVAL;
+	}
+
+	if (READ_ONCE(sock->unbound))
+		return -ENODEV;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	ret = vm_insert_page(vma, vma->vm_start, virt_to_page(sock->shared));
+	if (ret)
+		return ret;
+
+	vma->vm_ops		= &hsmp_shared_vm_ops;
+	vma->vm_private_data	= sock;
+	hsmp_shared_vm_open(vma);
+
+	return 0;
+}
+
+static const struct file_operations hsmp_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hsmp_open,
+	.release	= hsmp_release,
+	.mmap		= hsmp_mmap,
+	.unlocked_ioctl	= hsmp_ioctl,
+	.compat_ioctl	= hsmp_ioctl,
+};
+
+/*
+ * Opening a socket device with O_EXCL fails if it is already open, and
+ * keeps others from opening it until released.
+ */
+static void hsmp_sock_put(struct hsmp_socket *sock, struct file *fp)
+{
+	spin_lock(&sock->open_lock);
+	sock->open_count--;
+	if (sock->excl_owner == fp)
+		sock->excl_owner = NULL;
+	spin_unlock(&sock->open_lock);
+}
+
+/* misc_open() leaves the miscdevice of the socket in private_data */
+static int hsmp_sock_open(struct inode *inode, struct file *fp)
+{
+	struct hsmp_socket *sock = container_of(fp->private_data,
+						struct hsmp_socket, cdev);
+	int ret = 0;
+
+	spin_lock(&sock->open_lock);
+	if (sock->excl_owner || ((fp->f_flags & O_EXCL) && sock->open_count)) {
+		ret = -EBUSY;
+	} else {
+		sock->open_count++;
+		if (fp->f_flags & O_EXCL)
+			sock->excl_owner = fp;
+	}
+	spin_unlock(&sock->open_lock);
+	if (ret)
+		return ret;
+
+	ret = hsmp_file_open(fp, sock);
+	if (ret)
+		hsmp_sock_put(sock, fp);
+
+	return ret;
+}
+
+static int hsmp_sock_release(struct inode *inode, struct file *fp)
+{
+	hsmp_sock_put(hsmp_file_sock(fp), fp);
+
+	return hsmp_release(inode, fp);
+}
+
+static const struct file_operations hsmp_sock_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hsmp_sock_open,
+	.release	= hsmp_sock_release,
+	.mmap		= hsmp_mmap,
+	.unlocked_ioctl	= hsmp_ioctl,
+	.compat_ioctl	= hsmp_ioctl,
+};
+
+/* This is the UUID used for HSMP */
+static const guid_t acpi_hsmp_uuid = GUID_INIT(0xb74d619d, 0x5707, 0x48bd,
+						0xa6, 0x9f, 0x4e, 0xa2,
+						0x87, 0x1f, 0xc2, 0xf6);
+
+static inline bool is_acpi_hsmp_uuid(union acpi_object *obj)
+{
+	if (obj->type == ACPI_TYPE_BUFFER && obj->buffer.length == UUID_SIZE)
+		return guid_equal((guid_t *)obj->buffer.pointer, &acpi_hsmp_uuid);
+
+	return false;
+}
+
+static inline int hsmp_get_uid(struct device *dev, u16 *sock_ind)
+{
+	char *uid;
+
+	/*
+	 * UID (ID00, ID01..IDXX) is used for differentiating sockets,
+	 * read it and strip the "ID" part of it and convert the remaining
+	 * bytes to integer.
+	 */
+	uid = acpi_device_uid(ACPI_COMPANION(dev));
+
+	return kstrtou16(uid + 2, 10, sock_ind);
+}
+
+static acpi_status hsmp_resource(struct acpi_resource *res, void *data)
+{
+	struct hsmp_socket *sock = data;
+	struct resource r;
+
+	switch (res->type) {
+	case ACPI_RESOURCE_TYPE_FIXED_MEMORY32:
+		if (!acpi_dev_resource_memory(res, &r))
+			return AE_ERROR;
+		if (!r.start || r.end < r.start || !(r.flags & IORESOURCE_MEM_WRITEABLE))
+			return AE_ERROR;
+		sock->mbinfo.base_addr = r.start;
+		sock->mbinfo.size = resource_size(&r);
+		break;
+	case ACPI_RESOURCE_TYPE_END_TAG:
+		break;
+	default:
+		return AE_ERROR;
+	}
+
+	return AE_OK;
+}
+
+static int hsmp_read_acpi_dsd(struct hsmp_socket *sock)
+{
+	struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
+	union acpi_object *guid, *mailbox_package;
+	union acpi_object *dsd;
+	acpi_status status;
+	int ret = 0;
+	int j;
+
+	status = acpi_evaluate_object_typed(ACPI_HANDLE(sock->dev), "_DSD", NULL,
+					    &buf, ACPI_TYPE_PACKAGE);
+	if (ACPI_FAILURE(status)) {
+		dev_err(sock->dev, "Failed to read mailbox reg offsets from DSD table, err: %s\n",
+			acpi_format_exception(status));
+		return -ENODEV;
+	}
+
+	dsd = buf.pointer;
+
+	/* HSMP _DSD property should contain 2 objects.
+	 * 1. guid which is an acpi object of type ACPI_TYPE_BUFFER
+	 * 2. mailbox which is an acpi object of type ACPI_TYPE_PACKAGE
+	 *    This mailbox object contains 3 more acpi objects of type
+	 *    ACPI_TYPE_PACKAGE for holding msgid, msgresp, msgarg offsets
+	 *    these packages inturn contain 2 acpi objects of type
+	 *    ACPI_TYPE_STRING and ACPI_TYPE_INTEGER
+	 */
+	if (!dsd || dsd->type != ACPI_TYPE_PACKAGE || dsd->package.count != 2) {
+		ret = -EINVAL;
+		goto free_buf;
+	}
+
+	guid = &dsd->package.elements[0];
+	mailbox_package = &dsd->package.elements[1];
+	if (!is_acpi_hsmp_uuid(guid) || mailbox_package->type != ACPI_TYPE_PACKAGE) {
+		dev_err(sock->dev, "Invalid hsmp _DSD table data\n");
+		ret = -EINVAL;
+		goto free_buf;
+	}
+
+	for (j = 0; j < mailbox_package->package.count; j++) {
+		union acpi_object *msgobj, *msgstr, *msgint;
+
+		msgobj	= &mailbox_package->package.elements[j];
+		msgstr	= &msgobj->package.elements[0];
+		msgint	= &msgobj->package.elements[1];
+
+		/* package should have 1 string and 1 integer object */
+		if (msgobj->type != ACPI_TYPE_PACKAGE ||
+		    msgstr->type != ACPI_TYPE_STRING ||
+		    msgint->type != ACPI_TYPE_INTEGER) {
+			ret = -EINVAL;
+			goto free_buf;
+		}
+
+		if (!strncmp(msgstr->string.pointer, MSG_IDOFF_STR,
+			     msgstr->string.length)) {
+			sock->mbinfo.msg_id_off = msgint->integer.value;
+		} else if (!strncmp(msgstr->string.pointer, MSG_RESPOFF_STR,
+				    msgstr->string.length)) {
+			sock->mbinfo.msg_resp_off =  msgint->integer.value;
+		} else if (!strncmp(msgstr->string.pointer, MSG_ARGOFF_STR,
+				    msgstr->string.length)) {
+			sock->mbinfo.msg_arg_off = msgint->integer.value;
+		} else {
+			ret = -ENOENT;
+			goto free_buf;
+		}
+	}
+
+	if (!sock->mbinfo.msg_id_off || !sock->mbinfo.msg_resp_off ||
+	    !sock->mbinfo.msg_arg_off)
+		ret = -EINVAL;
+
+free_buf:
+	ACPI_FREE(buf.pointer);
+	return ret;
+}
+
+static int hsmp_read_acpi_crs(struct hsmp_socket *sock)
+{
+	acpi_status status;
+
+	status = acpi_walk_resources(ACPI_HANDLE(sock->dev), METHOD_NAME__CRS,
+				     hsmp_resource, sock);
+	if (ACPI_FAILURE(status)) {
+		dev_err(sock->dev, "Failed to look up MP1 base address from CRS method, err: %s\n",
+			acpi_format_exception(status));
+		return -EINVAL;
+	}
+	if (!sock->mbinfo.base_addr || !sock->mbinfo.size)
+		return -EINVAL;
+
+	/* The mapped region should be un cached */
+	sock->virt_base_addr = devm_ioremap_uc(sock->dev, sock->mbinfo.base_addr,
+					       sock->mbinfo.size);
+	if (!sock->virt_base_addr) {
+		dev_err(sock->dev, "Failed to ioremap MP1 base address\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Parse the ACPI table to read the data */
+static int hsmp_parse_acpi_table(struct device *dev, u16 sock_ind)
+{
+	struct hsmp_socket *sock = plat_dev.sock[sock_ind];
+	int ret;
+
+	sock->sock_ind		= sock_ind;
+	sock->dev		= dev;
+	sock->ops		= &hsmp_acpi_mbox_ops;
+	plat_dev.is_acpi_device	= true;
+
+	/* Read MP1 base address from CRS method */
+	ret = hsmp_read_acpi_crs(sock);
+	if (ret)
+		return ret;
+
+	/* Read mailbox offsets from DSD table */
+	return hsmp_read_acpi_dsd(sock);
+}
+
+static ssize_t hsmp_metric_tbl_read(struct file *filp, struct kobject *kobj,
+				    struct bin_attribute *bin_attr, char *buf,
+				    loff_t off, size_t count)
+{
+	struct hsmp_socket *sock = bin_attr->private;
+	struct hsmp_message msg = { 0 };
+	int ret;
+
+	if (!sock)
+		return -EINVAL;
+
+	/*
+	 * Every read refreshes the table and copies only the requested range,
+	 * so reading a few fields with pread() costs a fraction of the uncached
+	 * accesses of the whole table. The socket stays locked until the copy
+	 * is done, so that no other GET_METRIC_TABLE rewrites the table in the
+	 * middle of it and one read is one consistent snapshot.
+	 */
+	if (off >= bin_attr->size)
+		return 0;
+	count = min_t(size_t, count, bin_attr->size - off);
+
+	msg.msg_id	= HSMP_GET_METRIC_TABLE;
+	msg.sock_ind	= sock->sock_ind;
+
+	/* World readable, so served behind SET and in-kernel callers */
+	ret = hsmp_sock_lock(sock, HSMP_PRIO_LOW);
+	if (ret < 0)
+		return ret;
+
+	trace_hsmp_msg_request(&msg);
+	ret = hsmp_send_locked(sock, &msg);
+	trace_hsmp_msg_complete(&msg, ret);
+	if (!ret)
+		memcpy_fromio(buf, sock->metric_tbl_addr + off, count);
+
+	hsmp_sock_unlock(sock);
+
+	return ret ? ret : count;
+}
+
+static int hsmp_get_tbl_dram_base(u16 sock_ind)
+{
+	struct hsmp_socket *sock = plat_dev.sock[sock_ind];
+	struct hsmp_message msg = { 0 };
+	phys_addr_t dram_addr;
+	int ret;
+
+	msg.sock_ind	= sock_ind;
+	msg.response_sz	= plat_dev.msg_desc[HSMP_GET_METRIC_TABLE_DRAM_ADDR].response_sz;
+	msg.msg_id	= HSMP_GET_METRIC_TABLE_DRAM_ADDR;
+
+	ret = hsmp_send_message(&msg);
+	if (ret)
+		return ret;
+
+	/*
+	 * calculate the metric table DRAM address from lower and upper 32 bits
+	 * sent from SMU and ioremap it to virtual address.
+	 */
+	dram_addr = msg.args[0] | ((u64)(msg.args[1]) << 32);
+	if (!dram_addr) {
+		dev_err(sock->dev, "Invalid DRAM address for metric table\n");
+		return -ENOMEM;
+	}
+	sock->metric_tbl_addr = devm_ioremap(sock->dev, dram_addr,
+					     sizeof(struct hsmp_metric_table));
+	if (!sock->metric_tbl_addr) {
+		dev_err(sock->dev, "Failed to ioremap metric table addr\n");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int hsmp_gov_send(struct hsmp_socket *sock, u32 msg_id, u32 *value)
+{
+	struct hsmp_message msg = { 0 };
+	int ret;
+
+	msg.msg_id	= msg_id;
+	msg.num_args	= plat_dev.msg_desc[msg_id].num_args;
+	msg.response_sz	= plat_dev.msg_desc[msg_id].response_sz;
+	msg.sock_ind	= sock->sock_ind;
+	if (msg.num_args)
+		msg.args[0] = *value;
+
+	ret = hsmp_send_message(&msg);
+	if (!ret && msg.response_sz)
+		*value = msg.args[0];
+
+	return ret;
+}
+
+/*
+ * PI controller tracking the power target by adjusting the socket power limit.
+ * The error is the target minus the measured socket power, both in mWatts.
+ * The integral term is only accumulated while the output is not saturated.
+ */
+static void hsmp_gov_work(struct work_struct *work)
+{
+	struct hsmp_governor *gov = container_of(to_delayed_work(work),
+						 struct hsmp_governor, work);
+	struct hsmp_socket *sock = container_of(gov, struct hsmp_socket, gov);
+	s64 err, integral, limit;
+	u32 power, new_limit;
+
+	mutex_lock(&gov->lock);
+	if (!gov->target)
+		goto unlock;
+
+	if (hsmp_gov_send(sock, HSMP_GET_SOCKET_POWER, &power))
+		goto requeue;
+
+	err		= (s64)gov->target - power;
+	integral	= gov->integral + err;
+	limit		= gov->target + div_s64(gov_kp * err + gov_ki * integral, 1000);
+
+	if (limit > gov->limit_max)
+		new_limit = gov->limit_max;
+	else if (limit < 0)
+		new_limit = 0;
+	else
+		new_limit = limit;
+
+	if (new_limit == limit)
+		gov->integral = integral;
+
+	if (new_limit != gov->limit &&
+	    !hsmp_gov_send(sock, HSMP_SET_SOCKET_POWER_LIMIT, &new_limit))
+		gov->limit = new_limit;
+
+requeue:
+	queue_delayed_work(system_highpri_wq, &gov->work,
+			   msecs_to_jiffies(gov->interval_ms));
+unlock:
+	mutex_unlock(&gov->lock);
+}
+
+static void hsmp_gov_init(struct hsmp_socket *sock)
+{
+	struct hsmp_governor *gov = &sock->gov;
+
+	mutex_init(&gov->ctl_lock);
+	mutex_init(&gov->lock);
+	INIT_DELAYED_WORK(&gov->work, hsmp_gov_work);
+	gov->interval_ms = HSMP_GOV_INTERVAL_DEF;
+}
+
+/*
+ * Stop the governor and restore the power limit found when it was started.
+ * Called with ctl_lock held, so no new loop starts before the old one is
+ * cancelled and its limit restored.
+ */
+static void hsmp_gov_stop(struct hsmp_socket *sock)
+{
+	struct hsmp_governor *gov = &sock->gov;
+	u32 saved_limit;
+
+	mutex_lock(&gov->lock);
+	if (!gov->target) {
+		mutex_unlock(&gov->lock);
+		return;
+	}
+	gov->target	= 0;
+	saved_limit	= gov->saved_limit;
+	mutex_unlock(&gov->lock);
+
+	cancel_delayed_work_sync(&gov->work);
+
+	if (hsmp_gov_send(sock, HSMP_SET_SOCKET_POWER_LIMIT, &saved_limit))
+		dev_warn(sock->dev, "Socket %u failed to restore power limit\n",
+			 sock->sock_ind);
+}
+
+static int hsmp_gov_set_target(struct hsmp_socket *sock, u32 target)
+{
+	struct hsmp_governor *gov = &sock->gov;
+	u32 limit, limit_max;
+	int ret = 0;
+
+	mutex_lock(&gov->ctl_lock);
+	if (!target) {
+		hsmp_gov_stop(sock);
+		goto unlock;
+	}
+
+	/* Checked under ctl_lock, hsmp_sock_unbind() sets it under ctl_lock */
+	if (sock->unbound) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	mutex_lock(&gov->lock);
+	if (gov->target) {
+		gov->target = target;
+		mutex_unlock(&gov->lock);
+		goto unlock;
+	}
+	mutex_unlock(&gov->lock);
+
+	ret = hsmp_gov_send(sock, HSMP_GET_SOCKET_POWER_LIMIT_MAX, &limit_max);
+	if (ret)
+		goto unlock;
+	ret = hsmp_gov_send(sock, HSMP_GET_SOCKET_POWER_LIMIT, &limit);
+	if (ret)
+		goto unlock;
+
+	mutex_lock(&gov->lock);
+	gov->saved_limit	= limit;
+	gov->limit		= limit;
+	gov->limit_max		= limit_max;
+	gov->integral		= 0;
+	gov->target		= target;
+	queue_delayed_work(system_highpri_wq, &gov->work, 0);
+	mutex_unlock(&gov->lock);
+
+unlock:
+	mutex_unlock(&gov->ctl_lock);
+	return ret;
+}
+
+/* GET message of each aggregated metric */
+static const u32 hsmp_agg_msgs[HSMP_AGG_NR] = {
+	[HSMP_AGG_POWER]	= HSMP_GET_SOCKET_POWER,
+	[HSMP_AGG_TEMP]		= HSMP_GET_TEMP_MONITOR,
+	[HSMP_AGG_C0]		= HSMP_GET_C0_PERCENT,
+	[HSMP_AGG_DDR_UTIL]	= HSMP_GET_DDR_BANDWIDTH,
+	[HSMP_AGG_CCLK_LIMIT]	= HSMP_GET_CCLK_THROTTLE_LIMIT,
+};
+
+static u32 hsmp_agg_decode(int metric, u32 raw)
+{
+	switch (metric) {
+	case HSMP_AGG_TEMP:
+		return HSMP_TEMP_MILLIDEG(raw);
+	case HSMP_AGG_DDR_UTIL:
+		return HSMP_DDR_BW_PCT(raw);
+	default:
+		return raw;
+	}
+}
+
+static void hsmp_agg_work(struct work_struct *work)
+{
+	struct hsmp_agg *agg = container_of(to_delayed_work(work), struct hsmp_agg, work);
+	struct hsmp_socket *sock = container_of(agg, struct hsmp_socket, agg);
+	struct hsmp_agg_sample sample = { 0 };
+	struct hsmp_message msg = { 0 };
+	int i;
+
+	if (!READ_ONCE(agg->interval_ms) || READ_ONCE(sock->unbound))
+		return;
+
+	/* Low priority, the aggregation must not delay SET messages */
+	for (i = 0; i < HSMP_AGG_NR; i++) {
+		msg.msg_id	= hsmp_agg_msgs[i];
+		msg.response_sz	= plat_dev.msg_desc[msg.msg_id].response_sz;
+		msg.sock_ind	= sock->sock_ind;
+		if (hsmp_sock_send(sock, &msg, HSMP_PRIO_LOW))
+			continue;
+		sample.val[i]	= hsmp_agg_decode(i, msg.args[0]);
+		sample.valid	|= BIT(i);
+	}
+	sample.stamp_ns = ktime_get_ns();
+
+	mutex_lock(&agg->lock);
+	if (agg->interval_ms && !sock->unbound) {
+		agg->ring[agg->head]	= sample;
+		agg->head		= (agg->head + 1) % HSMP_AGG_SAMPLES;
+		agg->count		= min_t(u32, agg->count + 1, HSMP_AGG_SAMPLES);
+		queue_delayed_work(system_wq, &agg->work, msecs_to_jiffies(agg->interval_ms));
+	}
+	mutex_unlock(&agg->lock);
+}
+
+static void hsmp_agg_init(struct hsmp_socket *sock)
+{
+	struct hsmp_agg *agg = &sock->agg;
+
+	mutex_init(&agg->lock);
+	INIT_DELAYED_WORK(&agg->work, hsmp_agg_work);
+	agg->window_ms = HSMP_AGG_WINDOW_DEF;
+}
+
+static void hsmp_agg_free(struct hsmp_socket *sock)
+{
+	kvfree(sock->agg.ring);
+	kvfree(sock->agg.scratch);
+}
+
+/* Start, restart with an empty window or stop (interval 0) the aggregation */
+static int hsmp_agg_set_interval(struct hsmp_socket *sock, u32 interval)
+{
+	struct hsmp_agg *agg = &sock->agg;
+	int ret = 0;
+
+	mutex_lock(&agg->lock);
+	/* Checked under the lock, hsmp_sock_unbind() sets it under the lock */
+	if (sock->unbound) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	if (interval && !agg->ring) {
+		agg->ring	= kvcalloc(HSMP_AGG_SAMPLES, sizeof(*agg->ring), GFP_KERNEL);
+		agg->scratch	= kvcalloc(HSMP_AGG_SAMPLES, sizeof(*agg->scratch), GFP_KERNEL);
+		if (!agg->ring || !agg->scratch) {
+			hsmp_agg_free(sock);
+			agg->ring	= NULL;
+			agg->scratch	= NULL;
+			ret		= -ENOMEM;
+			goto unlock;
+		}
+	}
+
+	/* A stopped work item does not requeue itself, no need to cancel it */
+	if (interval && !agg->interval_ms) {
+		agg->head	= 0;
+		agg->count	= 0;
+		mod_delayed_work(system_wq, &agg->work, 0);
+	}
+	agg->interval_ms = interval;
+
+unlock:
+	mutex_unlock(&agg->lock);
+	return ret;
+}
+
+static int hsmp_u32_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of n sorted values */
+static inline u32 hsmp_percentile(const u32 *v, u32 n, u32 pct)
+{
+	return v[DIV_ROUND_UP(n * pct, 100) - 1];
+}
+
+/*
+ * Statistics of a metric over the samples of the last window, as
+ * "min max mean p50 p90 p99 samples". The ring is walked from the newest
+ * sample back, so the walk stops at the first sample out of the window.
+ */
+static ssize_t hsmp_agg_show(struct hsmp_socket *sock, int metric, char *buf)
+{
+	const struct hsmp_agg_sample *sample;
+	struct hsmp_agg *agg = &sock->agg;
+	u64 now, since, sum = 0;
+	u32 i, n = 0;
+	ssize_t ret;
+	u32 *v;
+
+	if (!test_bit(hsmp_agg_msgs[metric], sock->supported))
+		return -ENOMSG;
+
+	mutex_lock(&agg->lock);
+	if (!agg->ring) {
+		ret = -ENODATA;
+		goto unlock;
+	}
+
+	now	= ktime_get_ns();
+	since	= now - min_t(u64, now, (u64)agg->window_ms * NSEC_PER_MSEC);
+	v	= agg->scratch;
+	for (i = 0; i < agg->count; i++) {
+		sample = &agg->ring[(agg->head + HSMP_AGG_SAMPLES - 1 - i) % HSMP_AGG_SAMPLES];
+		if (sample->stamp_ns < since)
+			break;
+		if (sample->valid & BIT(metric)) {
+			v[n]	= sample->val[metric];
+			sum	+= v[n++];
+		}
+	}
+	if (!n) {
+		ret = -ENODATA;
+		goto unlock;
+	}
+
+	sort(v, n, sizeof(*v), hsmp_u32_cmp, NULL);
+	ret = sysfs_emit(buf, "%u %u %llu %u %u %u %u\n", v[0], v[n - 1], div_u64(sum, n),
+			 hsmp_percentile(v, n, 50), hsmp_percentile(v, n, 90),
+			 hsmp_percentile(v, n, 99), n);
+
+unlock:
+	mutex_unlock(&agg->lock);
+	return ret;
+}
+
+static inline struct hsmp_socket *to_hsmp_socket(struct device_attribute *attr)
+{
+	return container_of(attr, struct dev_ext_attribute, attr)->var;
+}
+
+static ssize_t power_target_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(sock->gov.target));
+}
+
+static ssize_t power_target_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+	u32 target;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &target);
+	if (ret)
+		return ret;
+
+	ret = hsmp_gov_set_target(sock, target);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(power_target);
+
+static ssize_t power_interval_ms_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(sock->gov.interval_ms));
+}
+
+static ssize_t power_interval_ms_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+	u32 interval;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &interval);
+	if (ret)
+		return ret;
+	if (!interval || interval > HSMP_GOV_INTERVAL_MAX)
+		return -EINVAL;
+
+	mutex_lock(&sock->gov.lock);
+	sock->gov.interval_ms = interval;
+	mutex_unlock(&sock->gov.lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(power_interval_ms);
+
+static ssize_t supported_msgs_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+
+	return sysfs_emit(buf, "%*pbl\n", HSMP_MSG_ID_MAX, sock->supported);
+}
+static DEVICE_ATTR_RO(supported_msgs);
+
+#define HSMP_SOCK_STAT_ATTR(_name, _field)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)		\
+{										\
+	struct hsmp_socket *sock = to_hsmp_socket(attr);			\
+										\
+	return sysfs_emit(buf, "%llu\n", READ_ONCE(sock->stats._field));	\
+}										\
+static DEVICE_ATTR_RO(_name)
+
+HSMP_SOCK_STAT_ATTR(msgs_sent, sent);
+HSMP_SOCK_STAT_ATTR(msgs_failed, failed);
+HSMP_SOCK_STAT_ATTR(msgs_timedout, timedout);
+
+static ssize_t agg_interval_ms_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(sock->agg.interval_ms));
+}
+
+static ssize_t agg_interval_ms_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+	u32 interval;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &interval);
+	if (ret)
+		return ret;
+	if (interval > HSMP_AGG_INTERVAL_MAX)
+		return -EINVAL;
+
+	ret = hsmp_agg_set_interval(sock, interval);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(agg_interval_ms);
+
+static ssize_t agg_window_ms_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(sock->agg.window_ms));
+}
+
+static ssize_t agg_window_ms_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct hsmp_socket *sock = to_hsmp_socket(attr);
+	u32 window;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &window);
+	if (ret)
+		return ret;
+	if (!window || window > HSMP_AGG_WINDOW_MAX)
+		return -EINVAL;
+
+	mutex_lock(&sock->agg.lock);
+	sock->agg.window_ms = window;
+	mutex_unlock(&sock->agg.lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(agg_window_ms);
+
+#define HSMP_SOCK_AGG_ATTR(_name, _metric)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)		\
+{										\
+	return hsmp_agg_show(to_hsmp_socket(attr), _metric, buf);		\
+}										\
+static DEVICE_ATTR_RO(_name)
+
+HSMP_SOCK_AGG_ATTR(agg_power, HSMP_AGG_POWER);
+HSMP_SOCK_AGG_ATTR(agg_temp, HSMP_AGG_TEMP);
+HSMP_SOCK_AGG_ATTR(agg_c0_residency, HSMP_AGG_C0);
+HSMP_SOCK_AGG_ATTR(agg_ddr_util, HSMP_AGG_DDR_UTIL);
+HSMP_SOCK_AGG_ATTR(agg_cclk_limit, HSMP_AGG_CCLK_LIMIT);
+
+/* Per socket attributes, instantiated for each socket with a pointer to it */
+static struct device_attribute *hsmp_sock_attrs[] = {
+	&dev_attr_power_target,
+	&dev_attr_power_interval_ms,
+	&dev_attr_supported_msgs,
+	&dev_attr_msgs_sent,
+	&dev_attr_msgs_failed,
+	&dev_attr_msgs_timedout,
+	&dev_attr_agg_interval_ms,
+	&dev_attr_agg_window_ms,
+	&dev_attr_agg_power,
+	&dev_attr_agg_temp,
+	&dev_attr_agg_c0_residency,
+	&dev_attr_agg_ddr_util,
+	&dev_attr_agg_cclk_limit,
+};
+
+static umode_t hsmp_is_sock_attr_visible(struct kobject *kobj,
+					 struct bin_attribute *battr, int id)
+{
+	if (plat_dev.proto_ver == HSMP_PROTO_VER6)
+		return battr->attr.mode;
+	else
+		return 0;
+}
+
+static void hsmp_init_metric_tbl_bin_attr(struct bin_attribute **hattrs, u16 sock_ind)
+{
+	struct bin_attribute *hattr = &plat_dev.sock[sock_ind]->hsmp_attr;
+
+	sysfs_bin_attr_init(hattr);
+	hattr->attr.name	= HSMP_METRICS_TABLE_NAME;
+	hattr->attr.mode	= 0444;
+	hattr->read		= hsmp_metric_tbl_read;
+	hattr->size		= sizeof(struct hsmp_metric_table);
+	hattr->private		= plat_dev.sock[sock_ind];
+	hattrs[0]		= hattr;
+}
+
+/* One bin sysfs for metrics table */
+#define NUM_HSMP_ATTRS		1
+
+static int hsmp_create_attr_list(struct attribute_group *attr_grp,
+				 struct device *dev, u16 sock_ind)
 {
 	struct bin_attribute **hsmp_bin_attrs;
+	struct dev_ext_attribute *ext_attrs;
+	struct attribute **hsmp_attrs;
+	int i;
+
+	/* Null terminated list of attributes */
+	hsmp_bin_attrs = devm_kcalloc(dev, NUM_HSMP_ATTRS + 1,
+				      sizeof(*hsmp_bin_attrs),
+				      GFP_KERNEL);
+	if (!hsmp_bin_attrs)
+		return -ENOMEM;
+
+	attr_grp->bin_attrs = hsmp_bin_attrs;
+
+	hsmp_attrs = devm_kcalloc(dev, ARRAY_SIZE(hsmp_sock_attrs) + 1,
+				  sizeof(*hsmp_attrs), GFP_KERNEL);
+	ext_attrs = devm_kcalloc(dev, ARRAY_SIZE(hsmp_sock_attrs),
+				 sizeof(*ext_attrs), GFP_KERNEL);
+	if (!hsmp_attrs || !ext_attrs)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(hsmp_sock_attrs); i++) {
+		ext_attrs[i].attr	= *hsmp_sock_attrs[i];
+		ext_attrs[i].var	= plat_dev.sock[sock_ind];
+		sysfs_attr_init(&ext_attrs[i].attr.attr);
+		hsmp_attrs[i]		= &ext_attrs[i].attr.attr;
+	}
+
+	attr_grp->attrs = hsmp_attrs;
+
+	hsmp_init_metric_tbl_bin_attr(hsmp_bin_attrs, sock_ind);
+
+	return 0;
+}
+
+static int hsmp_create_non_acpi_sysfs_if(struct device *dev)
+{
+	const struct attribute_group **hsmp_attr_grps;
+	struct attribute_group *attr_grp;
+	u16 i;
+
+	hsmp_attr_grps = devm_kcalloc(dev, plat_dev.num_sockets + 1,
+				      sizeof(*hsmp_attr_grps),
+				      GFP_KERNEL);
+	if (!hsmp_attr_grps)
+		return -ENOMEM;
+
+	/* Create a sysfs directory for each socket */
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		attr_grp = devm_kzalloc(dev, sizeof(struct attribute_group),
+					GFP_KERNEL);
+		if (!attr_grp)
+			return -ENOMEM;
+
+		snprintf(plat_dev.sock[i]->name, HSMP_ATTR_GRP_NAME_SIZE, "socket%u", (u8)i);
+		attr_grp->name			= plat_dev.sock[i]->name;
+		attr_grp->is_bin_visible	= hsmp_is_sock_attr_visible;
+		hsmp_attr_grps[i]		= attr_grp;
+
+		hsmp_create_attr_list(attr_grp, dev, i);
+	}
+
+	return devm_device_add_groups(dev, hsmp_attr_grps);
+}
+
+static int hsmp_create_acpi_sysfs_if(struct device *dev)
+{
+	struct attribute_group *attr_grp;
+	u16 sock_ind;
+	int ret;
+
+	attr_grp = devm_kzalloc(dev, sizeof(struct attribute_group), GFP_KERNEL);
+	if (!attr_grp)
+		return -ENOMEM;
+
+	attr_grp->is_bin_visible = hsmp_is_sock_attr_visible;
+
+	ret = hsmp_get_uid(dev, &sock_ind);
+	if (ret)
+		return ret;
+
+	ret = hsmp_create_attr_list(attr_grp, dev, sock_ind);
+	if (ret)
+		return ret;
+
+	return devm_device_add_group(dev, attr_grp);
+}
+
+static const u32 hsmp_core_limit_msg[HSMP_CORE_LIMIT_NR] = {
+	[HSMP_CORE_BOOST_LIMIT]	= HSMP_GET_BOOST_LIMIT,
+	[HSMP_CORE_CCLK_LIMIT]	= HSMP_GET_CCLK_CORE_LIMIT,
+};
+
+static int hsmp_read_core_limit(unsigned int cpu, enum hsmp_core_limit_type type,
+				u32 *limit)
+{
+	struct hsmp_core_cache *cache;
+	u16 sock_ind;
+	u32 apicid;
+	int ret = 0;
+
+	ret = hsmp_cpu_to_sock(cpu, &sock_ind, &apicid);
+	if (ret)
+		return ret;
+
+	cache = &plat_dev.sock[sock_ind]->core_cache;
+
+	mutex_lock(&cache->lock);
+	if (!cache->valid[type] || time_after(jiffies, cache->expires[type])) {
+		ret = hsmp_get_sock_core_limits(sock_ind, hsmp_core_limit_msg[type],
+						plat_dev.core_limits[type], nr_cpu_ids,
+						HSMP_PRIO_LOW);
+		cache->valid[type]	= !ret;
+		cache->expires[type]	= jiffies + msecs_to_jiffies(core_limit_ttl_ms);
+	}
+	*limit = plat_dev.core_limits[type][cpu];
+	mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+static ssize_t boost_limit_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	u32 limit;
+	int ret;
+
+	ret = hsmp_read_core_limit(dev->id, HSMP_CORE_BOOST_LIMIT, &limit);
+	if (ret)
+		return ret;
+
+	return sysfs_emit(buf, "%u\n", limit);
+}
+
+static ssize_t boost_limit_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct hsmp_core_cache *cache;
+	u16 sock_ind;
+	u32 apicid;
+	u32 limit;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &limit);
+	if (ret)
+		return ret;
+
+	ret = hsmp_cpu_to_sock(dev->id, &sock_ind, &apicid);
+	if (ret)
+		return ret;
+
+	ret = __hsmp_send_cpu_message(HSMP_SET_BOOST_LIMIT, dev->id, &limit, HSMP_PRIO_HIGH);
+	if (ret)
+		return ret;
+
+	/* The firmware may clamp the limit, read it back on the next show */
+	cache = &plat_dev.sock[sock_ind]->core_cache;
+	mutex_lock(&cache->lock);
+	cache->valid[HSMP_CORE_BOOST_LIMIT] = false;
+	mutex_unlock(&cache->lock);
+
+	return count;
+}
+static DEVICE_ATTR_ADMIN_RW(boost_limit);
+
+static ssize_t cclk_limit_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	u32 limit;
+	int ret;
+
+	ret = hsmp_read_core_limit(dev->id, HSMP_CORE_CCLK_LIMIT, &limit);
+	if (ret)
+		return ret;
+
+	return sysfs_emit(buf, "%u\n", limit);
+}
+static DEVICE_ATTR_RO(cclk_limit);
+
+static struct attribute *hsmp_cpu_attrs[] = {
+	&dev_attr_boost_limit.attr,
+	&dev_attr_cclk_limit.attr,
+	NULL
+};
+
+/* Per-CPU directory, /sys/devices/system/cpu/cpuN/hsmp */
+static const struct attribute_group hsmp_cpu_attr_group = {
+	.name	= "hsmp",
+	.attrs	= hsmp_cpu_attrs,
+};
+
+/* A failure here would roll back the CPU online, only warn about it */
+static int hsmp_cpu_online(unsigned int cpu)
+{
+	struct device *dev = get_cpu_device(cpu);
+
+	if (!dev)
+		return 0;
+
+	if (sysfs_create_group(&dev->kobj, &hsmp_cpu_attr_group))
+		dev_warn(dev, "Failed to create HSMP sysfs group\n");
+	else
+		cpumask_set_cpu(cpu, &plat_dev.cpu_sysfs);
+
+	return 0;
+}
+
+static int hsmp_cpu_offline(unsigned int cpu)
+{
+	struct device *dev = get_cpu_device(cpu);
+
+	if (dev && cpumask_test_and_clear_cpu(cpu, &plat_dev.cpu_sysfs))
+		sysfs_remove_group(&dev->kobj, &hsmp_cpu_attr_group);
+
+	return 0;
+}
+
+static int hsmp_create_cpu_sysfs_if(void)
+{
+	int ret;
+
+	ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "platform/x86/amd_hsmp:online",
+				hsmp_cpu_online, hsmp_cpu_offline);
+	if (ret < 0)
+		return ret;
+
+	plat_dev.cpuhp_state = ret;
+
+	return 0;
+}
+
+static int hsmp_cache_proto_ver(u16 sock_ind)
+{
+	struct hsmp_message msg = { 0 };
+	int ret;
+
+	msg.msg_id	= HSMP_GET_PROTO_VER;
+	msg.sock_ind	= sock_ind;
+	msg.response_sz = plat_dev.msg_desc[HSMP_GET_PROTO_VER].response_sz;
+
+	ret = hsmp_send_message(&msg);
+	if (!ret) {
+		WRITE_ONCE(plat_dev.proto_ver, msg.args[0]);
+		WRITE_ONCE(plat_dev.msg_desc, hsmp_select_msg_desc(msg.args[0]));
+	}
+
+	return ret;
+}
+
+/*
+ * Build the supported message bitmap of a socket from the protocol version.
+ * Messages the firmware still rejects are cleared on first use.
+ */
+static void hsmp_init_caps(struct hsmp_socket *sock)
+{
+	int i;
+
+	for (i = HSMP_TEST; i < HSMP_MSG_ID_MAX; i++) {
+		if (plat_dev.msg_desc[i].type != HSMP_RSVD)
+			set_bit(i, sock->supported);
+		else
+			clear_bit(i, sock->supported);
+	}
+}
+
+/* Check whether the firmware of a socket implements a message */
+bool hsmp_msg_supported(u16 sock_ind, u32 msg_id)
+{
+	if (!plat_dev.sock || sock_ind >= plat_dev.num_sockets ||
+	    msg_id >= HSMP_MSG_ID_MAX)
+		return false;
+
+	return test_bit(msg_id, plat_dev.sock[sock_ind]->supported);
+}
+EXPORT_SYMBOL_GPL(hsmp_msg_supported);
+
+/*
+ * Bring up the mailbox of one socket: run the test message, read the
+ * protocol version and map the metrics table if the protocol provides one.
+ * Without the handshake, reading the protocol version is the first message
+ * and its failure reports an unusable mailbox.
+ */
+static int hsmp_init_socket(struct device *dev, u16 sock_ind)
+{
+	int ret;
+
+	if (probe_handshake) {
+		ret = hsmp_test(sock_ind, 0xDEADBEEF);
+		if (ret) {
+			dev_err(dev, "HSMP test message failed on Fam:%x model:%x\n",
+				boot_cpu_data.x86, boot_cpu_data.x86_model);
+			dev_err(dev, "Is HSMP disabled in BIOS ?\n");
+			return ret;
+		}
+	}
+
+	ret = hsmp_cache_proto_ver(sock_ind);
+	if (ret) {
+		dev_err(dev, "Failed to read HSMP protocol version\n");
+		return ret;
+	}
 
-	/* Null terminated list of attributes */
-	hsmp_bin_attrs = devm_kcalloc(dev, NUM_HSMP_ATTRS + 1,
-				      sizeof(*hsmp_bin_attrs),
-				      GFP_KERNEL);
-	if (!hsmp_bin_attrs)
-		return -ENOMEM;
+	hsmp_init_caps(plat_dev.sock[sock_ind]);
 
-	attr_grp->bin_attrs = hsmp_bin_attrs;
+	if (plat_dev.proto_ver == HSMP_PROTO_VER6)
+		return hsmp_get_tbl_dram_base(sock_ind);
 
-	return hsmp_init_metric_tbl_bin_attr(hsmp_bin_attrs, sock_ind);
+	return 0;
 }
 
-static int hsmp_create_non_acpi_sysfs_if(struct device *dev)
+/*
+ * The /dev/hsmp misc device is shared by all sockets and registered only
+ * once, when the first ACPI socket or all the non-ACPI sockets are usable.
+ */
+static int hsmp_register_misc(struct device *dev)
 {
-	const struct attribute_group **hsmp_attr_grps;
-	struct attribute_group *attr_grp;
-	u16 i;
+	int ret = 0;
 
-	hsmp_attr_grps = devm_kcalloc(dev, plat_dev.num_sockets + 1,
-				      sizeof(*hsmp_attr_grps),
-				      GFP_KERNEL);
-	if (!hsmp_attr_grps)
-		return -ENOMEM;
+	mutex_lock(&hsmp_probe_lock);
+	if (plat_dev.is_probed)
+		goto unlock;
 
-	/* Create a sysfs directory for each socket */
-	for (i = 0; i < plat_dev.num_sockets; i++) {
-		attr_grp = devm_kzalloc(dev, sizeof(struct attribute_group),
-					GFP_KERNEL);
-		if (!attr_grp)
-			return -ENOMEM;
+	plat_dev.hsmp_device.name	= HSMP_CDEV_NAME;
+	plat_dev.hsmp_device.minor	= MISC_DYNAMIC_MINOR;
+	plat_dev.hsmp_device.fops	= &hsmp_fops;
+	plat_dev.hsmp_device.parent	= dev;
+	plat_dev.hsmp_device.nodename	= HSMP_DEVNODE_NAME;
+	plat_dev.hsmp_device.mode	= 0644;
 
-		snprintf(plat_dev.sock[i].name, HSMP_ATTR_GRP_NAME_SIZE, "socket%u", (u8)i);
-		attr_grp->name			= plat_dev.sock[i].name;
-		attr_grp->is_bin_visible	= hsmp_is_sock_attr_visible;
-		hsmp_attr_grps[i]		= attr_grp;
+	ret = misc_register(&plat_dev.hsmp_device);
+	if (ret)
+		goto unlock;
 
-		hsmp_create_attr_list(attr_grp, dev, i);
-	}
+	if (hsmp_create_cpu_sysfs_if())
+		dev_err(dev, "Failed to create HSMP per-CPU sysfs interface\n");
 
-	return devm_device_add_groups(dev, hsmp_attr_grps);
+	plat_dev.is_probed = true;
+
+unlock:
+	mutex_unlock(&hsmp_probe_lock);
+	return ret;
 }
 
-static int hsmp_create_acpi_sysfs_if(struct device *dev)
+/* Device node of a single socket, registered once the socket is usable */
+static int hsmp_register_sock_cdev(struct device *dev, struct hsmp_socket *sock)
 {
-	struct attribute_group *attr_grp;
-	u16 sock_ind;
 	int ret;
 
-	attr_grp = devm_kzalloc(dev, sizeof(struct attribute_group), GFP_KERNEL);
-	if (!attr_grp)
-		return -ENOMEM;
-
-	attr_grp->is_bin_visible = hsmp_is_sock_attr_visible;
+	snprintf(sock->cdev_name, HSMP_SOCK_CDEV_NAME_SIZE, HSMP_SOCK_CDEV_NAME,
+		 sock->sock_ind);
+	sock->cdev.name		= sock->cdev_name;
+	sock->cdev.minor	= MISC_DYNAMIC_MINOR;
+	sock->cdev.fops		= &hsmp_sock_fops;
+	sock->cdev.parent	= dev;
+	sock->cdev.mode		= 0644;
 
-	ret = hsmp_get_uid(dev, &sock_ind);
-	if (ret)
+	ret = misc_register(&sock->cdev);
+	if (ret) {
+		dev_err(dev, "Failed to register %s\n", sock->cdev_name);
 		return ret;
+	}
+	sock->cdev_registered = true;
 
-	ret = hsmp_create_attr_list(attr_grp, dev, sock_ind);
-	if (ret)
-		return ret;
+	return 0;
+}
 
-	return devm_device_add_group(dev, attr_grp);
+static void hsmp_unregister_sock_cdev(struct hsmp_socket *sock)
+{
+	if (sock->cdev_registered) {
+		misc_deregister(&sock->cdev);
+		sock->cdev_registered = false;
+	}
 }
 
-static int hsmp_cache_proto_ver(u16 sock_ind)
+/* The misc device is shared by all sockets, deregister it once none is bound */
+static void hsmp_unregister_misc(void)
 {
-	struct hsmp_message msg = { 0 };
-	int ret;
+	u16 i;
 
-	msg.msg_id	= HSMP_GET_PROTO_VER;
-	msg.sock_ind	= sock_ind;
-	msg.response_sz = hsmp_msg_desc_table[HSMP_GET_PROTO_VER].response_sz;
+	mutex_lock(&hsmp_probe_lock);
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		if (!READ_ONCE(plat_dev.sock[i]->unbound))
+			goto unlock;
+	}
 
-	ret = hsmp_send_message(&msg);
-	if (!ret)
-		plat_dev.proto_ver = msg.args[0];
+	if (plat_dev.is_probed) {
+		if (plat_dev.cpuhp_state > 0) {
+			cpuhp_remove_state(plat_dev.cpuhp_state);
+			plat_dev.cpuhp_state = 0;
+		}
+		misc_deregister(&plat_dev.hsmp_device);
+		plat_dev.is_probed = false;
+	}
 
-	return ret;
+unlock:
+	mutex_unlock(&hsmp_probe_lock);
 }
 
 static inline bool is_f1a_m0h(void)
@@ -743,16 +3528,74 @@ static inline bool is_f1a_m0h(void)
 	return false;
 }
 
+struct hsmp_probe_ctx {
+	struct device *dev;
+	u16 sock_ind;
+	int ret;
+};
+
+static void hsmp_init_socket_async(void *data, async_cookie_t cookie)
+{
+	struct hsmp_probe_ctx *ctx = data;
+
+	ctx->ret = hsmp_init_socket(ctx->dev, ctx->sock_ind);
+}
+
+/*
+ * Map the config space of the socket root complex from the MMCONFIG window
+ * described by MSR_FAM10H_MMIO_CONF_BASE. Only segment 0 is covered by it,
+ * the socket stays on the config space accessors otherwise.
+ */
+static void hsmp_map_ecam(struct device *dev, struct hsmp_socket *sock)
+{
+	u64 msr, base;
+	u32 bus_range;
+	u8 bus;
+
+	if (pci_domain_nr(sock->root->bus) != 0)
+		return;
+
+	if (rdmsrl_safe(MSR_FAM10H_MMIO_CONF_BASE, &msr) ||
+	    !(msr & FAM10H_MMIO_CONF_ENABLE))
+		return;
+
+	base		= msr & (FAM10H_MMIO_CONF_BASE_MASK << FAM10H_MMIO_CONF_BASE_SHIFT);
+	bus_range	= 1U << ((msr >> FAM10H_MMIO_CONF_BUSRANGE_SHIFT) &
+				 FAM10H_MMIO_CONF_BUSRANGE_MASK);
+	bus		= sock->root->bus->number;
+	if (bus >= bus_range)
+		return;
+
+	sock->ecam_base = devm_ioremap(dev, base + ((u64)bus << 20) +
+				       ((u64)sock->root->devfn << 12), PAGE_SIZE);
+	if (!sock->ecam_base) {
+		dev_warn(dev, "Socket %u failed to map ECAM, using config accessors\n",
+			 sock->sock_ind);
+		return;
+	}
+
+	sock->ops = &hsmp_ecam_mbox_ops;
+}
+
 static int init_platform_device(struct device *dev)
 {
+	struct hsmp_probe_ctx *ctx;
 	struct hsmp_socket *sock;
-	int ret, i;
+	int ret = 0, i;
 
 	for (i = 0; i < plat_dev.num_sockets; i++) {
-		if (!node_to_amd_nb(i))
-			return -ENODEV;
-		sock = &plat_dev.sock[i];
-		sock->root			= node_to_amd_nb(i)->root;
+		sock = plat_dev.sock[i];
+		if (sim_mbox) {
+			sock->sim = devm_kzalloc(dev, sizeof(*sock->sim), GFP_KERNEL);
+			if (!sock->sim)
+				return -ENOMEM;
+			sock->ops		= &hsmp_sim_mbox_ops;
+		} else {
+			if (!node_to_amd_nb(i))
+				return -ENODEV;
+			sock->root		= node_to_amd_nb(i)->root;
+			sock->ops		= &hsmp_pci_mbox_ops;
+		}
 		sock->sock_ind			= i;
 		sock->dev			= dev;
 		sock->mbinfo.base_addr		= SMN_HSMP_BASE;
@@ -768,19 +3611,47 @@ static int init_platform_device(struct device *dev)
 
 		sock->mbinfo.msg_resp_off	= SMN_HSMP_MSG_RESP;
 		sock->mbinfo.msg_arg_off	= SMN_HSMP_MSG_DATA;
-		sema_init(&sock->hsmp_sem, 1);
+		WRITE_ONCE(sock->unbound, false);
 
-		/* Test the hsmp interface on each socket */
-		ret = hsmp_test(i, 0xDEADBEEF);
-		if (ret) {
-			dev_err(dev, "HSMP test message failed on Fam:%x model:%x\n",
-				boot_cpu_data.x86, boot_cpu_data.x86_model);
-			dev_err(dev, "Is HSMP disabled in BIOS ?\n");
-			return ret;
+		if (ecam_mbox && sock->root)
+			hsmp_map_ecam(dev, sock);
+	}
+
+	ctx = kcalloc(plat_dev.num_sockets, sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	/*
+	 * Test the hsmp interface on each socket. The sockets are brought up
+	 * concurrently, each from its own NUMA node, as every test message may
+	 * take up to the SMU response time.
+	 */
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		ctx[i].dev	= dev;
+		ctx[i].sock_ind	= i;
+		sock = plat_dev.sock[i];
+		async_schedule_node_domain(hsmp_init_socket_async, &ctx[i],
+					   sock->root ? dev_to_node(&sock->root->dev) : NUMA_NO_NODE,
+					   &hsmp_async_domain);
+	}
+	async_synchronize_full_domain(&hsmp_async_domain);
+
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		if (ctx[i].ret) {
+			ret = ctx[i].ret;
+			break;
 		}
 	}
+	kfree(ctx);
+	if (ret)
+		return ret;
 
-	return 0;
+	/* Expose the devices only once every socket is usable */
+	ret = hsmp_register_misc(dev);
+	for (i = 0; i < plat_dev.num_sockets && !ret; i++)
+		ret = hsmp_register_sock_cdev(dev, plat_dev.sock[i]);
+
+	return ret;
 }
 
 static const struct acpi_device_id amd_hsmp_acpi_ids[] = {
@@ -789,6 +3660,238 @@ static const struct acpi_device_id amd_hsmp_acpi_ids[] = {
 };
 MODULE_DEVICE_TABLE(acpi, amd_hsmp_acpi_ids);
 
+/* NUMA node of the first online CPU of the socket */
+static int hsmp_sock_node(u16 sock_ind)
+{
+	unsigned int cpu;
+
+	for_each_online_cpu(cpu) {
+		if (topology_logical_package_id(cpu) == sock_ind)
+			return cpu_to_node(cpu);
+	}
+
+	return NUMA_NO_NODE;
+}
+
+/*
+ * The sockets live as long as the module, so that files, mappings and
+ * sysfs attributes referencing a socket stay valid while devices are
+ * unbound and bound again. Nothing references them at module exit.
+ */
+static void hsmp_free_sockets(void)
+{
+	struct hsmp_socket *sock;
+	u16 i;
+
+	for (i = 0; i < HSMP_CORE_LIMIT_NR; i++) {
+		kfree(plat_dev.core_limits[i]);
+		plat_dev.core_limits[i] = NULL;
+	}
+
+	if (!plat_dev.sock)
+		return;
+
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		sock = plat_dev.sock[i];
+		if (!sock)
+			continue;
+
+		cancel_delayed_work_sync(&sock->gov.work);
+		cancel_delayed_work_sync(&sock->refresh);
+		cancel_delayed_work_sync(&sock->agg.work);
+		if (sock->shared)
+			free_page((unsigned long)sock->shared);
+		hsmp_agg_free(sock);
+		kfree(sock);
+	}
+	kfree(plat_dev.sock);
+	plat_dev.sock = NULL;
+}
+
+static int hsmp_alloc_sockets(void)
+{
+	struct hsmp_socket **sock;
+	struct page *page;
+	int i;
+
+	BUILD_BUG_ON(sizeof(struct hsmp_shared_page) +
+		     HSMP_MSG_ID_MAX * sizeof(struct hsmp_shared_entry) > PAGE_SIZE);
+
+	/* Limits behind the cpuN/hsmp files, which outlive any one device */
+	for (i = 0; i < HSMP_CORE_LIMIT_NR; i++) {
+		plat_dev.core_limits[i] = kcalloc(nr_cpu_ids, sizeof(*plat_dev.core_limits[i]),
+						  GFP_KERNEL);
+		if (!plat_dev.core_limits[i])
+			goto free_sockets;
+	}
+
+	sock = kcalloc(plat_dev.num_sockets, sizeof(*sock), GFP_KERNEL);
+	if (!sock)
+		goto free_sockets;
+	plat_dev.sock = sock;
+
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		sock[i] = kzalloc_node(sizeof(*sock[i]), GFP_KERNEL, hsmp_sock_node(i));
+		if (!sock[i])
+			goto free_sockets;
+
+		page = alloc_pages_node(hsmp_sock_node(i), GFP_KERNEL | __GFP_ZERO, 0);
+		if (!page)
+			goto free_sockets;
+		sock[i]->shared			= page_address(page);
+		sock[i]->shared->version	= HSMP_SHARED_VERSION;
+		sock[i]->shared->num_entries	= HSMP_MSG_ID_MAX;
+		sock[i]->shared->sock_ind	= i;
+		INIT_DELAYED_WORK(&sock[i]->refresh, hsmp_refresh_work);
+
+		/* Allow every message until the protocol version is known */
+		bitmap_fill(sock[i]->supported, HSMP_MSG_ID_MAX);
+		sock[i]->cpu		= nr_cpu_ids;
+		sock[i]->unbound	= true;
+		sema_init(&sock[i]->hsmp_sem, 1);
+		xa_init(&sock[i]->shadow);
+		spin_lock_init(&sock[i]->open_lock);
+		init_waitqueue_head(&sock[i]->lo_wq);
+		mutex_init(&sock[i]->core_cache.lock);
+		hsmp_gov_init(sock[i]);
+		hsmp_agg_init(sock[i]);
+	}
+
+	return 0;
+
+free_sockets:
+	hsmp_free_sockets();
+	return -ENOMEM;
+}
+
+#define HSMP_BENCH_ITERS	100
+
+/*
+ * Average HSMP_TEST round-trip through a transport in ns. The transport
+ * of the socket is only swapped with the socket locked, as every other
+ * mailbox access holds the lock too.
+ */
+static int hsmp_bench_ops(struct hsmp_socket *sock, const struct hsmp_mbox_ops *ops,
+			  u64 *avg_ns)
+{
+	const struct hsmp_mbox_ops *saved;
+	struct hsmp_message msg = { 0 };
+	u64 start, total = 0;
+	int i, ret = 0;
+
+	msg.msg_id	= HSMP_TEST;
+	msg.num_args	= 1;
+	msg.response_sz	= 1;
+	msg.sock_ind	= sock->sock_ind;
+
+	for (i = 0; i < HSMP_BENCH_ITERS && !ret; i++) {
+		msg.args[0] = i;
+
+		ret = down_timeout(&sock->hsmp_sem, msecs_to_jiffies(HSMP_MSG_TIMEOUT));
+		if (ret < 0)
+			return ret;
+
+		saved		= sock->ops;
+		sock->ops	= ops;
+		start		= ktime_get_ns();
+		ret		= __hsmp_send_message(sock, &msg);
+		total		+= ktime_get_ns() - start;
+		sock->ops	= saved;
+
+		hsmp_sock_unlock(sock);
+
+		if (!ret && msg.args[0] != i + 1)
+			ret = -EBADE;
+	}
+
+	*avg_ns = div_u64(total, i);
+
+	return ret;
+}
+
+/* Compare the config accessors with the ECAM mapping on each socket */
+static int hsmp_transport_bench_show(struct seq_file *m, void *unused)
+{
+	struct hsmp_socket *sock;
+	u64 pci_ns, ecam_ns;
+	int ret;
+	u16 i;
+
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		sock = plat_dev.sock[i];
+
+		seq_printf(m, "socket%u", i);
+
+		if (sock->sim) {
+			ret = hsmp_bench_ops(sock, &hsmp_sim_mbox_ops, &pci_ns);
+			if (ret)
+				return ret;
+			seq_printf(m, " sim %llu\n", pci_ns);
+			continue;
+		}
+
+		ret = hsmp_bench_ops(sock, &hsmp_pci_mbox_ops, &pci_ns);
+		if (ret)
+			return ret;
+		seq_printf(m, " pci %llu", pci_ns);
+
+		if (sock->ecam_base) {
+			ret = hsmp_bench_ops(sock, &hsmp_ecam_mbox_ops, &ecam_ns);
+			if (ret)
+				return ret;
+			seq_printf(m, " ecam %llu", ecam_ns);
+		}
+		seq_puts(m, "\n");
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hsmp_transport_bench);
+
+static void hsmp_debugfs_init(void)
+{
+	plat_dev.debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+	debugfs_create_file("transport_bench", 0400, plat_dev.debugfs, NULL,
+			    &hsmp_transport_bench_fops);
+}
+
+/*
+ * Stop using a socket whose device goes away. Its mailbox mapping is
+ * released with the device, so wait for the accesses in flight; later
+ * ones fail in hsmp_sock_lock().
+ */
+static void hsmp_sock_unbind(struct hsmp_socket *sock)
+{
+	hsmp_unregister_sock_cdev(sock);
+	/* No sysfs store can restart the governor or aggregation past this point */
+	mutex_lock(&sock->gov.ctl_lock);
+	hsmp_gov_stop(sock);
+	mutex_lock(&sock->agg.lock);
+	WRITE_ONCE(sock->unbound, true);
+	mutex_unlock(&sock->agg.lock);
+	mutex_unlock(&sock->gov.ctl_lock);
+
+	cancel_delayed_work_sync(&sock->refresh);
+	cancel_delayed_work_sync(&sock->agg.work);
+
+	down(&sock->hsmp_sem);
+	hsmp_sock_unlock(sock);
+
+	hsmp_shadow_invalidate(sock);
+}
+
+/* Unbind the sockets owned by a device, /dev/hsmp goes with the last one */
+static void hsmp_unbind_dev(struct device *dev)
+{
+	u16 i;
+
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		if (plat_dev.sock[i]->dev == dev)
+			hsmp_sock_unbind(plat_dev.sock[i]);
+	}
+	hsmp_unregister_misc();
+}
+
 static int hsmp_pltdrv_probe(struct platform_device *pdev)
 {
 	struct acpi_device *adev;
@@ -797,18 +3900,9 @@ static int hsmp_pltdrv_probe(struct platform_device *pdev)
 
 	/*
 	 * On ACPI supported BIOS, there is an ACPI HSMP device added for
-	 * each socket, so the per socket probing, but the memory allocated for
-	 * sockets should be contiguous to access it as an array,
-	 * Hence allocate memory for all the sockets at once instead of allocating
-	 * on each probe.
+	 * each socket, so the per socket probing. The sockets were allocated
+	 * at module init, each probe binds the sockets it owns.
 	 */
-	if (!plat_dev.is_probed) {
-		plat_dev.sock = devm_kcalloc(&pdev->dev, plat_dev.num_sockets,
-					     sizeof(*plat_dev.sock),
-					     GFP_KERNEL);
-		if (!plat_dev.sock)
-			return -ENOMEM;
-	}
 	adev = ACPI_COMPANION(&pdev->dev);
 	if (adev && !acpi_match_device_ids(adev, amd_hsmp_acpi_ids)) {
 		ret = hsmp_get_uid(&pdev->dev, &sock_ind);
@@ -822,25 +3916,24 @@ static int hsmp_pltdrv_probe(struct platform_device *pdev)
 			return ret;
 		}
 		/* Test the hsmp interface */
-		ret = hsmp_test(sock_ind, 0xDEADBEEF);
+		WRITE_ONCE(plat_dev.sock[sock_ind]->unbound, false);
+		ret = hsmp_init_socket(&pdev->dev, sock_ind);
+		if (!ret)
+			ret = hsmp_register_misc(&pdev->dev);
+		if (!ret)
+			ret = hsmp_register_sock_cdev(&pdev->dev, plat_dev.sock[sock_ind]);
 		if (ret) {
-			dev_err(&pdev->dev, "HSMP test message failed on Fam:%x model:%x\n",
-				boot_cpu_data.x86, boot_cpu_data.x86_model);
-			dev_err(&pdev->dev, "Is HSMP disabled in BIOS ?\n");
+			hsmp_unbind_dev(&pdev->dev);
 			return ret;
 		}
 	} else {
 		ret = init_platform_device(&pdev->dev);
 		if (ret) {
 			dev_err(&pdev->dev, "Failed to init HSMP mailbox\n");
+			hsmp_unbind_dev(&pdev->dev);
 			return ret;
 		}
-	}
-
-	ret = hsmp_cache_proto_ver(sock_ind);
-	if (ret) {
-		dev_err(&pdev->dev, "Failed to read HSMP protocol version\n");
-		return ret;
+		hsmp_debugfs_init();
 	}
 
 	if (plat_dev.is_acpi_device)
@@ -850,44 +3943,86 @@ static int hsmp_pltdrv_probe(struct platform_device *pdev)
 	if (ret)
 		dev_err(&pdev->dev, "Failed to create HSMP sysfs interface\n");
 
-	if (!plat_dev.is_probed) {
-		plat_dev.hsmp_device.name	= HSMP_CDEV_NAME;
-		plat_dev.hsmp_device.minor	= MISC_DYNAMIC_MINOR;
-		plat_dev.hsmp_device.fops	= &hsmp_fops;
-		plat_dev.hsmp_device.parent	= &pdev->dev;
-		plat_dev.hsmp_device.nodename	= HSMP_DEVNODE_NAME;
-		plat_dev.hsmp_device.mode	= 0644;
+	return 0;
+}
+
+static int hsmp_pltdrv_remove(struct platform_device *pdev)
+{
+	if (!plat_dev.is_acpi_device) {
+		debugfs_remove_recursive(plat_dev.debugfs);
+		plat_dev.debugfs = NULL;
+	}
+	hsmp_unbind_dev(&pdev->dev);
 
-		ret = misc_register(&plat_dev.hsmp_device);
-		if (ret)
-			return ret;
+	return 0;
+}
+
+/*
+ * The protocol version, capabilities and metrics table mapping stay valid
+ * across suspend, only the governors are parked. On ACPI platforms each
+ * device owns one socket, otherwise the single device owns all of them.
+ */
+static int hsmp_pltdrv_suspend(struct device *dev)
+{
+	struct hsmp_socket *sock;
+	u16 i;
 
-		plat_dev.is_probed = true;
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		sock = plat_dev.sock[i];
+		if (sock->dev != dev)
+			continue;
+
+		cancel_delayed_work_sync(&sock->gov.work);
+		cancel_delayed_work_sync(&sock->refresh);
+		cancel_delayed_work_sync(&sock->agg.work);
 	}
 
 	return 0;
 }
 
-static int hsmp_pltdrv_remove(struct platform_device *pdev)
+/* Restore the shadowed SET state without redoing the probe handshake */
+static int hsmp_pltdrv_resume(struct device *dev)
 {
-	/*
-	 * We register only one misc_device even on multi socket system.
-	 * So, deregister should happen only once.
-	 */
-	if (plat_dev.is_probed) {
-		misc_deregister(&plat_dev.hsmp_device);
-		plat_dev.is_probed = false;
+	struct hsmp_socket *sock;
+	int failed;
+	u16 i;
+
+	for (i = 0; i < plat_dev.num_sockets; i++) {
+		sock = plat_dev.sock[i];
+		if (sock->dev != dev)
+			continue;
+
+		failed = hsmp_shadow_replay(sock);
+		if (failed)
+			dev_warn(dev, "Socket %u failed to restore %d settings\n",
+				 sock->sock_ind, failed);
+
+		mutex_lock(&sock->gov.lock);
+		if (sock->gov.target)
+			queue_delayed_work(system_highpri_wq, &sock->gov.work, 0);
+		mutex_unlock(&sock->gov.lock);
+
+		if (atomic_read(&sock->mappers) && READ_ONCE(shared_refresh_ms))
+			queue_delayed_work(system_wq, &sock->refresh, 0);
+
+		mutex_lock(&sock->agg.lock);
+		if (sock->agg.interval_ms)
+			queue_delayed_work(system_wq, &sock->agg.work, 0);
+		mutex_unlock(&sock->agg.lock);
 	}
 
 	return 0;
 }
 
+static DEFINE_SIMPLE_DEV_PM_OPS(hsmp_pm_ops, hsmp_pltdrv_suspend, hsmp_pltdrv_resume);
+
 static struct platform_driver amd_hsmp_driver = {
 	.probe		= hsmp_pltdrv_probe,
 	.remove		= hsmp_pltdrv_remove,
 	.driver		= {
 		.name	= DRIVER_NAME,
 		.acpi_match_table = amd_hsmp_acpi_ids,
+		.pm	= pm_sleep_ptr(&hsmp_pm_ops),
 	},
 };
 
@@ -908,34 +4043,74 @@ static int hsmp_plat_dev_register(void)
 	return ret;
 }
 
+/* The driver tables must describe the same message shapes as the UAPI table */
+static bool __init hsmp_msg_desc_consistent(void)
+{
+	const struct hsmp_drv_msg_desc *desc;
+	int i;
+
+	desc = hsmp_drv_msg_desc_tables[HSMP_PROTO_VER_LATEST];
+	for (i = 0; i < HSMP_MSG_ID_MAX; i++) {
+		if (desc[i].type != hsmp_msg_desc_table[i].type ||
+		    desc[i].num_args != hsmp_msg_desc_table[i].num_args ||
+		    desc[i].response_sz != hsmp_msg_desc_table[i].response_sz)
+			return false;
+	}
+
+	return true;
+}
+
 static int __init hsmp_plt_init(void)
 {
 	int ret = -ENODEV;
 
-	if (boot_cpu_data.x86_vendor != X86_VENDOR_AMD || boot_cpu_data.x86 < 0x19) {
+	if (WARN_ON(!hsmp_msg_desc_consistent()))
+		return ret;
+
+	if (!sim_mbox &&
+	    (boot_cpu_data.x86_vendor != X86_VENDOR_AMD || boot_cpu_data.x86 < 0x19)) {
 		pr_err("HSMP is not supported on Family:%x model:%x\n",
 		       boot_cpu_data.x86, boot_cpu_data.x86_model);
 		return ret;
 	}
 
 	/*
-	 * amd_nb_num() returns number of SMN/DF interfaces present in the system
-	 * if we have N SMN/DF interfaces that ideally means N sockets
+	 * Each package has one HSMP mailbox, reached through one SMN/DF
+	 * interface per package. The package count alone overcounts on BIOSes
+	 * listing disabled CPUs in the MADT, so it only sizes the simulated
+	 * mailbox, which has no SMN/DF interface.
 	 */
-	plat_dev.num_sockets = amd_nb_num();
-	if (plat_dev.num_sockets == 0 || plat_dev.num_sockets > MAX_AMD_SOCKETS)
+	if (sim_mbox)
+		plat_dev.num_sockets = topology_max_packages();
+	else
+		plat_dev.num_sockets = min_t(u16, amd_nb_num(), topology_max_packages());
+	if (plat_dev.num_sockets == 0)
 		return ret;
 
-	ret = platform_driver_register(&amd_hsmp_driver);
+	/*
+	 * On ACPI supported BIOS each socket has its own device, but the
+	 * sockets are accessed as an array, so allocate them all at once.
+	 */
+	ret = hsmp_alloc_sockets();
 	if (ret)
 		return ret;
 
+	ret = platform_driver_register(&amd_hsmp_driver);
+	if (ret)
+		goto free_sockets;
+
 	if (!plat_dev.is_acpi_device) {
 		ret = hsmp_plat_dev_register();
-		if (ret)
+		if (ret) {
 			platform_driver_unregister(&amd_hsmp_driver);
+			goto free_sockets;
+		}
 	}
 
+	return 0;
+
+free_sockets:
+	hsmp_free_sockets();
 	return ret;
 }
 
@@ -943,6 +4118,7 @@ static void __exit hsmp_plt_exit(void)
 {
 	platform_device_unregister(amd_hsmp_platdev);
 	platform_driver_unregister(&amd_hsmp_driver);
+	hsmp_free_sockets();
 }
 
 device_initcall(hsmp_plt_init);
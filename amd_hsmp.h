@@ -409,8 +409,201 @@ struct hsmp_metric_table {
 /* Reset to default packing */
 #pragma pack()
 
+/*
+ * Bulk per-core frequency limit readout.
+ *
+ * msg_id selects HSMP_GET_CCLK_CORE_LIMIT or HSMP_GET_BOOST_LIMIT. The driver
+ * translates every online logical CPU below num_cpus to its socket and APIC ID,
+ * sends the message and stores the result in MHz at limits[cpu].
+ * Entries for offline CPUs are set to 0.
+ */
+struct hsmp_core_limits {
+	__u32	msg_id;			/* HSMP_GET_CCLK_CORE_LIMIT or HSMP_GET_BOOST_LIMIT */
+	__u32	num_cpus;		/* in: entries in limits[], out: entries filled */
+	__u64	limits;			/* user pointer to __u32 array indexed by logical CPU */
+};
+
+/*
+ * Per-core message keyed by Linux logical CPU number.
+ *
+ * Supported for HSMP_SET_BOOST_LIMIT, HSMP_GET_BOOST_LIMIT and
+ * HSMP_GET_CCLK_CORE_LIMIT. The driver resolves the socket and APIC ID
+ * of the CPU and packs them into the mailbox arguments.
+ */
+struct hsmp_cpu_message {
+	__u32	msg_id;			/* Message ID */
+	__u32	cpu;			/* Linux logical CPU number */
+	__u32	value;			/* in: boost limit in MHz, out: limit in MHz */
+};
+
+#define HSMP_MAX_TXN_MSGS	8
+
+/*
+ * Transaction of messages to one socket.
+ *
+ * The messages are sent in order with the socket locked, so no other caller
+ * can interleave. The previous values of the SET messages are read back first
+ * and restored if a later message fails. A SET message without a readback,
+ * i.e. other than HSMP_SET_SOCKET_POWER_LIMIT, HSMP_SET_BOOST_LIMIT or
+ * HSMP_SET_NBIO_DPM_LEVEL, is restored to the value last applied through
+ * the driver. If the driver has not applied one since probe or resume, it
+ * is only accepted as the last message, otherwise the transaction fails
+ * with -EINVAL and failed_ind set to its index before anything is sent.
+ */
+struct hsmp_txn {
+	__u16	sock_ind;		/* socket number, overrides msgs[].sock_ind */
+	__u16	num_msgs;		/* Number of messages in msgs[] */
+	__u32	failed_ind;		/* out: index of the failed message */
+	struct hsmp_message msgs[HSMP_MAX_TXN_MSGS];
+};
+
+#define HSMP_MAX_BATCH_MSGS	256
+
+/*
+ * Batch of independent messages, possibly to different sockets.
+ *
+ * The messages are sent in order, each one like HSMP_IOCTL_CMD, and the
+ * batch stops at the first failure. Unlike a transaction nothing is rolled
+ * back and other callers may interleave between messages.
+ */
+struct hsmp_batch {
+	__u32	num_msgs;		/* Number of messages in msgs[] */
+	__u32	done;			/* out: number of messages completed */
+	__u64	msgs;			/* user pointer to struct hsmp_message array */
+};
+
+#define HSMP_MAX_SAMPLE_MSGS	4
+#define HSMP_MAX_SAMPLES	4096
+#define HSMP_MAX_SAMPLE_MS	1000
+
+/* One row of HSMP_IOCTL_SAMPLE, resp[i] is the response of msgs[i] */
+struct hsmp_sample {
+	__u64	stamp_ns;		/* CLOCK_MONOTONIC time of the row */
+	__u32	resp[HSMP_MAX_SAMPLE_MSGS];
+};
+
+/*
+ * Periodic sampling of GET messages of one socket inside the driver.
+ *
+ * Every interval_us the messages are sent in order and their single word
+ * responses stored in a row of samples[]. Rows are spaced by timer
+ * accuracy rather than by scheduling. The socket is locked for each row
+ * and released between rows. interval_us must not be zero and
+ * num_samples * interval_us is limited to HSMP_MAX_SAMPLE_MS milliseconds.
+ * A series that falls behind ends after HSMP_MAX_SAMPLE_MS with
+ * num_samples set to the rows taken.
+ */
+struct hsmp_sample_req {
+	__u16	sock_ind;		/* socket number, overrides msgs[].sock_ind */
+	__u16	num_msgs;		/* Number of messages in msgs[] */
+	__u32	num_samples;		/* in: rows requested, out: rows taken */
+	__u32	interval_us;		/* Period of the rows in microseconds */
+	__u32	reserved;
+	__u64	samples;		/* user pointer to struct hsmp_sample array */
+	struct hsmp_message msgs[HSMP_MAX_SAMPLE_MSGS];
+};
+
+/*
+ * Priority class of an open file, set with HSMP_IOCTL_SET_PRIO.
+ *
+ * Callers of the HIGH class take the socket mailbox ahead of every waiting
+ * LOW caller. Files open for writing and in-kernel users are HIGH, read-only
+ * files start as LOW. Raising a file to HIGH needs CAP_SYS_ADMIN.
+ */
+enum hsmp_prio_class {
+	HSMP_PRIO_LOW	= 0,
+	HSMP_PRIO_HIGH	= 1,
+};
+
+/*
+ * Read-only page of last-known GET results, one per socket, mapped with
+ * mmap() on /dev/hsmp at offset sock_ind * page size, or at offset 0 on
+ * /dev/hsmpN.
+ *
+ * entries[] is indexed by msg_id and filled for the GET messages without
+ * arguments, e.g. HSMP_GET_SOCKET_POWER, HSMP_GET_TEMP_MONITOR or
+ * HSMP_GET_C0_PERCENT, after each successful round-trip. seq is odd while
+ * the driver updates an entry, readers retry until they see the same even
+ * seq before and after reading it. stamp_ns is the CLOCK_MONOTONIC time of
+ * the response, 0 until the entry is first filled.
+ */
+#define HSMP_SHARED_VERSION	1
+
+struct hsmp_shared_entry {
+	__u32	seq;			/* Odd while the entry is updated */
+	__u32	reserved;
+	__u64	stamp_ns;		/* CLOCK_MONOTONIC time of args, 0 if none */
+	__u32	args[2];		/* Response of the last successful GET */
+};
+
+struct hsmp_shared_page {
+	__u32	version;		/* HSMP_SHARED_VERSION */
+	__u32	num_entries;		/* Number of entries, HSMP_MSG_ID_MAX */
+	__u16	sock_ind;		/* Socket the page describes */
+	__u16	reserved[3];
+	struct hsmp_shared_entry entries[];
+};
+
+/*
+ * Field accessors for packed message arguments and responses,
+ * see the message descriptions above for the layouts.
+ */
+#define HSMP_FIELD(x, hi, lo)		(((__u32)(x) >> (lo)) & ((1U << ((hi) - (lo) + 1)) - 1))
+
+/* HSMP_SET_BOOST_LIMIT */
+#define HSMP_BOOST_LIMIT_ARG(apicid, mhz)	(((__u32)(apicid) << 16) | ((mhz) & 0xFFFF))
+
+/* HSMP_SET_XGMI_LINK_WIDTH, HSMP_SET_GMI3_WIDTH */
+#define HSMP_LINK_WIDTH_ARG(min, max)		((((min) & 0xFF) << 8) | ((max) & 0xFF))
+
+/* HSMP_SET_PSTATE_MAX_MIN */
+#define HSMP_PSTATE_MAX_MIN_ARG(min, max)	((((min) & 0xFF) << 8) | ((max) & 0xFF))
+
+/* HSMP_SET_NBIO_DPM_LEVEL, HSMP_GET_NBIO_DPM_LEVEL */
+#define HSMP_NBIO_DPM_ARG(nbio, max, min)	((((nbio) & 0xFF) << 16) | \
+						 (((max) & 0xFF) << 8) | ((min) & 0xFF))
+#define HSMP_NBIO_DPM_MAX(x)			HSMP_FIELD(x, 15, 8)
+#define HSMP_NBIO_DPM_MIN(x)			HSMP_FIELD(x, 7, 0)
+
+/* HSMP_GET_DDR_BANDWIDTH */
+#define HSMP_DDR_BW_MAX_GBPS(x)			HSMP_FIELD(x, 31, 20)
+#define HSMP_DDR_BW_USED_GBPS(x)		HSMP_FIELD(x, 19, 8)
+#define HSMP_DDR_BW_PCT(x)			HSMP_FIELD(x, 7, 0)
+
+/* HSMP_GET_TEMP_MONITOR, the fractional part is in 1/8 degree */
+#define HSMP_TEMP_INT(x)			HSMP_FIELD(x, 15, 8)
+#define HSMP_TEMP_FRAC(x)			HSMP_FIELD(x, 7, 5)
+#define HSMP_TEMP_MILLIDEG(x)			(HSMP_TEMP_INT(x) * 1000 + HSMP_TEMP_FRAC(x) * 125)
+
+/* HSMP_GET_DIMM_TEMP_RANGE */
+#define HSMP_DIMM_REFRESH_RATE(x)		HSMP_FIELD(x, 3, 3)
+#define HSMP_DIMM_TEMP_RANGE(x)			HSMP_FIELD(x, 2, 0)
+
+/* HSMP_GET_DIMM_POWER, HSMP_GET_DIMM_THERMAL */
+#define HSMP_DIMM_POWER_MW(x)			HSMP_FIELD(x, 31, 17)
+#define HSMP_DIMM_THERMAL_TEMP(x)		HSMP_FIELD(x, 31, 21)
+#define HSMP_DIMM_UPDATE_RATE_MS(x)		HSMP_FIELD(x, 16, 8)
+#define HSMP_DIMM_ADDR(x)			HSMP_FIELD(x, 7, 0)
+
+/* HSMP_GET_SOCKET_FREQ_LIMIT */
+#define HSMP_FREQ_LIMIT_MHZ(x)			HSMP_FIELD(x, 31, 16)
+#define HSMP_FREQ_LIMIT_SRC(x)			HSMP_FIELD(x, 15, 0)
+
+/* HSMP_GET_SOCKET_FMAX_FMIN */
+#define HSMP_FMAX_MHZ(x)			HSMP_FIELD(x, 31, 16)
+#define HSMP_FMIN_MHZ(x)			HSMP_FIELD(x, 15, 0)
+
+/* HSMP_GET_IOLINK_BANDWITH, HSMP_GET_XGMI_BANDWITH */
+#define HSMP_LINK_BW_ARG(link, type)		((((link) & 0xFF) << 8) | ((type) & 0x7))
+
 /* Define unique ioctl command for hsmp msgs using generic _IOWR */
 #define HSMP_BASE_IOCTL_NR	0xF8
 #define HSMP_IOCTL_CMD		_IOWR(HSMP_BASE_IOCTL_NR, 0, struct hsmp_message)
+#define HSMP_IOCTL_CORE_LIMITS	_IOWR(HSMP_BASE_IOCTL_NR, 1, struct hsmp_core_limits)
+#define HSMP_IOCTL_CPU_CMD	_IOWR(HSMP_BASE_IOCTL_NR, 2, struct hsmp_cpu_message)
+#define HSMP_IOCTL_TXN		_IOWR(HSMP_BASE_IOCTL_NR, 3, struct hsmp_txn)
+#define HSMP_IOCTL_BATCH	_IOWR(HSMP_BASE_IOCTL_NR, 4, struct hsmp_batch)
+#define HSMP_IOCTL_SET_PRIO	_IOW(HSMP_BASE_IOCTL_NR, 5, __u32)
+#define HSMP_IOCTL_SAMPLE	_IOWR(HSMP_BASE_IOCTL_NR, 6, struct hsmp_sample_req)
 
 #endif /*_ASM_X86_AMD_HSMP_H_*/
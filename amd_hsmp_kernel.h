@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef _ASM_X86_AMD_HSMP_H_
+#define _ASM_X86_AMD_HSMP_H_
+
+#include "amd_hsmp.h"
+
+/*
+ * In-kernel interface of the driver, exported for other subsystems.
+ */
+int hsmp_send_message(struct hsmp_message *msg);
+int hsmp_send_cpu_message(u32 msg_id, unsigned int cpu, u32 *value);
+bool hsmp_msg_supported(u16 sock_ind, u32 msg_id);
+
+#endif /*_ASM_X86_AMD_HSMP_H_*/
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the AMD HSMP driver
+ *
+ * hsmp_msg_request and hsmp_msg_complete bracket every message sent through
+ * the driver, hsmp_mbox marks the messages that reached the mailbox.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM amd_hsmp
+
+#if !defined(_AMD_HSMP_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _AMD_HSMP_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(hsmp_msg_request,
+
+	TP_PROTO(const struct hsmp_message *msg),
+
+	TP_ARGS(msg),
+
+	TP_STRUCT__entry(
+		__field(u32, msg_id)
+		__field(u16, num_args)
+		__field(u16, response_sz)
+		__field(u16, sock_ind)
+		__array(u32, args, HSMP_MAX_MSG_LEN)
+	),
+
+	TP_fast_assign(
+		__entry->msg_id		= msg->msg_id;
+		__entry->num_args	= msg->num_args;
+		__entry->response_sz	= msg->response_sz;
+		__entry->sock_ind	= msg->sock_ind;
+		memcpy(__entry->args, msg->args, sizeof(__entry->args));
+	),
+
+	TP_printk("sock=%u msg_id=%u num_args=%u response_sz=%u args=%s",
+		  __entry->sock_ind, __entry->msg_id, __entry->num_args,
+		  __entry->response_sz,
+		  __print_array(__entry->args, __entry->num_args, sizeof(u32)))
+);
+
+TRACE_EVENT(hsmp_msg_complete,
+
+	TP_PROTO(const struct hsmp_message *msg, int ret),
+
+	TP_ARGS(msg, ret),
+
+	TP_STRUCT__entry(
+		__field(u32, msg_id)
+		__field(int, ret)
+		__field(u16, response_sz)
+		__field(u16, sock_ind)
+		__array(u32, args, HSMP_MAX_MSG_LEN)
+	),
+
+	TP_fast_assign(
+		__entry->msg_id		= msg->msg_id;
+		__entry->ret		= ret;
+		__entry->response_sz	= msg->response_sz;
+		__entry->sock_ind	= msg->sock_ind;
+		memcpy(__entry->args, msg->args, sizeof(__entry->args));
+	),
+
+	TP_printk("sock=%u msg_id=%u ret=%d response=%s",
+		  __entry->sock_ind, __entry->msg_id, __entry->ret,
+		  __print_array(__entry->args, __entry->ret ? 0 : __entry->response_sz,
+				sizeof(u32)))
+);
+
+TRACE_EVENT(hsmp_mbox,
+
+	TP_PROTO(u16 sock_ind, u32 msg_id, u32 status, u64 duration_ns),
+
+	TP_ARGS(sock_ind, msg_id, status, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(u64, duration_ns)
+		__field(u32, msg_id)
+		__field(u32, status)
+		__field(u16, sock_ind)
+	),
+
+	TP_fast_assign(
+		__entry->duration_ns	= duration_ns;
+		__entry->msg_id		= msg_id;
+		__entry->status		= status;
+		__entry->sock_ind	= sock_ind;
+	),
+
+	TP_printk("sock=%u msg_id=%u status=0x%x duration_ns=%llu",
+		  __entry->sock_ind, __entry->msg_id, __entry->status,
+		  __entry->duration_ns)
+);
+
+#endif /* _AMD_HSMP_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE amd_hsmp_trace
+#include <trace/define_trace.h>
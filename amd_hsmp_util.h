@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * User space helpers for the AMD HSMP driver interface of amd_hsmp.h.
+ * Not part of the UAPI, copy or include it in client code.
+ */
+
+#ifndef _AMD_HSMP_UTIL_H_
+#define _AMD_HSMP_UTIL_H_
+
+#include "amd_hsmp.h"
+
+/*
+ * Columnar decoders for arrays of raw args[0] samples, e.g. archived time
+ * series. Each turns n samples into one array per field. The loops have no
+ * branches and no dependencies between iterations, and the outputs are
+ * restrict qualified, so compilers can vectorize them without runtime
+ * alias checks. The output arrays must not overlap each other or the input.
+ */
+
+/* HSMP_GET_DDR_BANDWIDTH */
+static inline void hsmp_decode_ddr_bw(const __u32 *__restrict raw, unsigned long n,
+				      __u32 *__restrict max_gbps, __u32 *__restrict used_gbps,
+				      __u32 *__restrict pct)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		max_gbps[i]	= HSMP_DDR_BW_MAX_GBPS(raw[i]);
+		used_gbps[i]	= HSMP_DDR_BW_USED_GBPS(raw[i]);
+		pct[i]		= HSMP_DDR_BW_PCT(raw[i]);
+	}
+}
+
+/* HSMP_GET_TEMP_MONITOR */
+static inline void hsmp_decode_temp(const __u32 *__restrict raw, unsigned long n,
+				    __u32 *__restrict millideg)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		millideg[i] = HSMP_TEMP_MILLIDEG(raw[i]);
+}
+
+/* HSMP_GET_DIMM_POWER */
+static inline void hsmp_decode_dimm_power(const __u32 *__restrict raw, unsigned long n,
+					  __u32 *__restrict mw, __u32 *__restrict rate_ms,
+					  __u32 *__restrict addr)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		mw[i]		= HSMP_DIMM_POWER_MW(raw[i]);
+		rate_ms[i]	= HSMP_DIMM_UPDATE_RATE_MS(raw[i]);
+		addr[i]		= HSMP_DIMM_ADDR(raw[i]);
+	}
+}
+
+/* HSMP_GET_DIMM_THERMAL */
+static inline void hsmp_decode_dimm_thermal(const __u32 *__restrict raw, unsigned long n,
+					    __u32 *__restrict temp, __u32 *__restrict rate_ms,
+					    __u32 *__restrict addr)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		temp[i]		= HSMP_DIMM_THERMAL_TEMP(raw[i]);
+		rate_ms[i]	= HSMP_DIMM_UPDATE_RATE_MS(raw[i]);
+		addr[i]		= HSMP_DIMM_ADDR(raw[i]);
+	}
+}
+
+/*
+ * HSMP_GET_SOCKET_FREQ_LIMIT (frequency, source) and
+ * HSMP_GET_SOCKET_FMAX_FMIN (fmax, fmin)
+ */
+static inline void hsmp_decode_hi_lo16(const __u32 *__restrict raw, unsigned long n,
+				       __u32 *__restrict hi, __u32 *__restrict lo)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		hi[i]	= HSMP_FIELD(raw[i], 31, 16);
+		lo[i]	= HSMP_FIELD(raw[i], 15, 0);
+	}
+}
+
+/*
+ * Read a consistent copy of an entry of a mapped struct hsmp_shared_page.
+ * Returns the CLOCK_MONOTONIC time of the response, 0 if msg_id has no
+ * result yet. Only sizeof(entry->args) words are copied to args.
+ */
+static inline __u64 hsmp_shared_read(const struct hsmp_shared_page *page, __u32 msg_id,
+				     __u32 *args)
+{
+	const struct hsmp_shared_entry *e;
+	__u64 stamp;
+	__u32 seq;
+
+	if (msg_id >= page->num_entries)
+		return 0;
+	e = &page->entries[msg_id];
+
+	do {
+		while ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		stamp	= __atomic_load_n(&e->stamp_ns, __ATOMIC_RELAXED);
+		args[0]	= __atomic_load_n(&e->args[0], __ATOMIC_RELAXED);
+		args[1]	= __atomic_load_n(&e->args[1], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq);
+
+	return stamp;
+}
+
+#endif /* _AMD_HSMP_UTIL_H_ */